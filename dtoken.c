@@ -34,316 +34,2573 @@
 #include <sys/time.h>
 #include <arpa/inet.h>
 #include <math.h>
-#include <gmp.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 #include "dtoken.h"
 
 /**
- * Add input port to the given token
+ * Append a field to the given token, above the bits already written
  *
- * @param mpz_t* token The token to add the port to
- * @param short int port The port to add
+ * The second word is always written (with nothing in it when the field fits
+ * in the first), so the cost is the same wherever the field lands.
+ *
+ * @param struct token_bits* token The token to append the field to
+ * @param uint64_t value The value of the field, no wider than size
+ * @param unsigned int size The width of the field in bits (at most 64)
+ *
+ * @return void
+ */
+static inline void put_bits(struct token_bits *token, uint64_t value, unsigned int size)
+{
+	unsigned int index = token->size >> 6;
+	unsigned int offset = token->size & 63;
+
+	token->word[index] |= value << offset;
+	token->word[index + 1] |= (value >> 1) >> (63 - offset);
+
+	token->size += size;
+}
+
+/**
+ * Split an IPv6 address into two 64-bit halves
+ *
+ * @param void* ip The address, as a struct in6_addr
+ * @param uint64_t* high Where to store the most significant half
+ * @param uint64_t* low Where to store the least significant half
+ *
+ * @return void
+ */
+static inline void split_ipv6(const void* ip, uint64_t *high, uint64_t *low)
+{
+	// s6_addr is in network order, most significant byte first
+	const unsigned char* bytes = ((const struct in6_addr *)ip)->s6_addr;
+	uint64_t h = 0, l = 0;
+
+	for (int i = 0; i < 8; i++)
+	{
+		h = (h << 8) | bytes[i];
+		l = (l << 8) | bytes[i + 8];
+	}
+
+	*high = h;
+	*low = l;
+}
+
+/*
+ * A configured IPv6 prefix, with the masks of the bits it covers in each half
+ * of an address
+ */
+struct ipv6_prefix
+{
+	uint64_t high;
+	uint64_t low;
+	uint64_t high_mask;
+	uint64_t low_mask;
+	unsigned int length;
+};
+
+/* Set once at startup by set_ipv6_prefixes(), only read afterwards */
+static struct ipv6_prefix ipv6_prefixes[IPv6_PREFIXES];
+static unsigned int ipv6_prefix_count = 0;
+
+/**
+ * Find the longest configured prefix that the given IPv6 address is in
+ *
+ * @param uint64_t high The most significant half of the address
+ * @param uint64_t low The least significant half of the address
+ *
+ * @return int The index of the prefix, or -1 if the address is in none
+ */
+static inline int find_ipv6_prefix(uint64_t high, uint64_t low)
+{
+	int found = -1;
+
+	for (unsigned int i = 0; i < ipv6_prefix_count; i++)
+	{
+		const struct ipv6_prefix* prefix = &ipv6_prefixes[i];
+
+		if ((high & prefix->high_mask) == prefix->high &&
+			(low & prefix->low_mask) == prefix->low &&
+			(found < 0 || prefix->length > ipv6_prefixes[found].length))
+		{
+			found = i;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * A dictionary address, the IPv4 ones in the low half with the high half clear
+ */
+struct known_address
+{
+	uint64_t high;
+	uint64_t low;
+	short int protocol;
+};
+
+/* Hash table of the dictionary, at most half full, and its buckets */
+#define DICTIONARY_SLOTS (DICTIONARY_ADDRESSES * 2)
+#define DICTIONARY_BUCKETS (DICTIONARY_SLOTS / 8)
+
+/*
+ * Set once at startup by set_address_dictionary(), only read afterwards. The
+ * hash is perfect: addresses are hashed to a bucket, and each bucket has a
+ * displacement moving its addresses to slots no other address uses, so a
+ * lookup is one hash and one compare.
+ */
+static struct known_address known_addresses[DICTIONARY_ADDRESSES];
+static unsigned int known_address_count = 0;
+static uint16_t known_slots[DICTIONARY_SLOTS]; /* index + 1 of the address in each slot, 0 if none */
+static uint16_t known_displacements[DICTIONARY_BUCKETS];
+static uint64_t known_seed = 0;
+static unsigned int known_slot_mask = 0;
+static unsigned int known_bucket_mask = 0;
+
+/**
+ * Mix the bits of a 64-bit value (the finaliser of MurmurHash3)
+ *
+ * @param uint64_t x The value to mix
+ *
+ * @return uint64_t The mixed value
+ */
+static inline uint64_t mix_bits(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+
+	return x;
+}
+
+/**
+ * Hash an address for the dictionary
+ *
+ * The bucket is taken from bits 40 and up, the slot from the low 32 bits
+ * plus the displacement times the high 32 bits (made odd).
+ *
+ * @param uint64_t high The most significant half of the address (0 for IPv4)
+ * @param uint64_t low The least significant half of the address
+ * @param short int protocol The protocol of the address (AF_INET or AF_INET6)
+ * @param uint64_t seed The seed the table was built with
+ *
+ * @return uint64_t The hash
+ */
+static inline uint64_t hash_address(uint64_t high, uint64_t low, short int protocol, uint64_t seed)
+{
+	return mix_bits(high ^ mix_bits(low ^ seed ^ ((uint64_t)protocol << 56)));
+}
+
+static inline unsigned int known_slot(uint64_t hash, unsigned int displacement, unsigned int mask)
+{
+	return ((uint32_t)hash + displacement * (uint32_t)((hash >> 32) | 1)) & mask;
+}
+
+/**
+ * Find an address in the address dictionary
+ *
+ * @param uint64_t high The most significant half of the address (0 for IPv4)
+ * @param uint64_t low The least significant half of the address
+ * @param short int protocol The protocol of the address (AF_INET or AF_INET6)
+ *
+ * @return int The index of the address, or -1 if it is not in the dictionary
+ */
+static inline int find_known_address(uint64_t high, uint64_t low, short int protocol)
+{
+	if (!known_address_count)
+	{
+		return -1;
+	}
+
+	uint64_t hash = hash_address(high, low, protocol, known_seed);
+	unsigned int displacement = known_displacements[(hash >> 40) & known_bucket_mask];
+	unsigned int index = known_slots[known_slot(hash, displacement, known_slot_mask)];
+
+	if (index == 0)
+	{
+		return -1;
+	}
+
+	const struct known_address* known = &known_addresses[index - 1];
+
+	return known->high == high && known->low == low && known->protocol == protocol ? (int)index - 1 : -1;
+}
+
+/* Enabled, protocol and compact bits followed by the compact kind */
+#define COMPACT_HEADER(kind) (1 | (INET6 << 1) | (1 << 2) | ((kind) << 3))
+#define COMPACT_HEADER_SIZE (3 + COMPACT_KIND_SIZE)
+
+/* The longest compact segment, a prefix index and the bits after the shortest prefix, fits in a full one */
+_Static_assert(
+	COMPACT_HEADER_SIZE + PREFIX_INDEX_SIZE + IPv6_SIZE - IPv6_PREFIX_MIN_LENGTH + 1 + PORT_SIZE <= ADDRESS_MAX_SIZE,
+	"IPv6_PREFIX_MIN_LENGTH is too short for ADDRESS_MAX_SIZE"
+);
+
+/**
+ * Write the enabled, protocol and address bits of an IPv6 address
+ *
+ * IPv4-mapped addresses are written as their IPv4 address, and addresses in
+ * a configured prefix as the index of the prefix and the bits after it. The
+ * compact bit is only clear for addresses written in full.
+ *
+ * @param struct token_bits* token The token to add the address to
+ * @param void* ip The address, as a struct in6_addr
+ *
+ * @return void
+ */
+static inline void put_ipv6(struct token_bits *token, const void* ip)
+{
+	uint64_t high, low;
+	split_ipv6(ip, &high, &low);
+
+	// ::ffff:a.b.c.d, as reported by dual-stack sockets for IPv4 clients
+	if (high == 0 && (low >> IPv4_SIZE) == 0xffff)
+	{
+		put_bits(
+			token,
+			COMPACT_HEADER(COMPACT_MAPPED) | ((low & 0xffffffff) << COMPACT_HEADER_SIZE),
+			COMPACT_HEADER_SIZE + IPv4_SIZE);
+		return;
+	}
+
+	int index = find_ipv6_prefix(high, low);
+	if (index >= 0)
+	{
+		const struct ipv6_prefix* prefix = &ipv6_prefixes[index];
+		unsigned int suffix = IPv6_SIZE - prefix->length;
+
+		put_bits(
+			token,
+			COMPACT_HEADER(COMPACT_PREFIX) | ((uint64_t)index << COMPACT_HEADER_SIZE),
+			COMPACT_HEADER_SIZE + PREFIX_INDEX_SIZE);
+
+		if (suffix > 64)
+		{
+			put_bits(token, low, 64);
+			put_bits(token, high & ~prefix->high_mask, suffix - 64);
+		}
+		else
+		{
+			put_bits(token, low & ~prefix->low_mask, suffix);
+		}
+		return;
+	}
+
+	put_bits(token, 1 | (INET6 << 1) | (low << 3), 64);
+	put_bits(token, (low >> 61) | (high << 3), 64);
+	put_bits(token, high >> 61, 3);
+}
+
+/*
+ * Address segment encoders
+ *
+ * One encoder is generated per address kind. Each writes the enabled bit,
+ * protocol bit, address, port flag and port as a fixed sequence of constant
+ * width fields, so there is nothing left to branch on, except for the
+ * IPv6 encoders choosing how to write the address.
+ */
+typedef void (*address_encoder)(struct token_bits *token, const void* ip, unsigned short port);
+
+#define IPv4_ENCODER(name, with_port) \
+	static void name(struct token_bits *token, const void* ip, unsigned short port) \
+	{ \
+		uint64_t address = ntohl(((const struct in_addr *)ip)->s_addr); \
+		put_bits( \
+			token, \
+			1 | \
+			(INET4 << 1) | \
+			(address << 2) | \
+			((uint64_t)(with_port) << (2 + IPv4_SIZE)) | \
+			((with_port) ? (uint64_t)port << (3 + IPv4_SIZE) : 0), \
+			3 + IPv4_SIZE + ((with_port) ? PORT_SIZE : 0)); \
+	}
+
+#define IPv6_ENCODER(name, with_port) \
+	static void name(struct token_bits *token, const void* ip, unsigned short port) \
+	{ \
+		put_ipv6(token, ip); \
+		put_bits( \
+			token, \
+			(uint64_t)(with_port) | \
+			((with_port) ? (uint64_t)port << 1 : 0), \
+			1 + ((with_port) ? PORT_SIZE : 0)); \
+	}
+
+static void encode_no_address(struct token_bits *token, const void* ip, unsigned short port)
+{
+	(void)ip;
+	(void)port;
+
+	put_bits(token, 0, 1); // 0 for disabled
+}
+
+IPv4_ENCODER(encode_ipv4, 0)
+IPv4_ENCODER(encode_ipv4_port, 1)
+IPv6_ENCODER(encode_ipv6, 0)
+IPv6_ENCODER(encode_ipv6_port, 1)
+
+static const address_encoder address_encoders[ADDRESS_KINDS] =
+{
+	[ADDRESS_NONE] = encode_no_address,
+	[ADDRESS_IPv4] = encode_ipv4,
+	[ADDRESS_IPv4_PORT] = encode_ipv4_port,
+	[ADDRESS_IPv6] = encode_ipv6,
+	[ADDRESS_IPv6_PORT] = encode_ipv6_port,
+};
+
+/*
+ * Time and method encoders, indexed by time type
+ *
+ * The time type bit, timestamp and method are written as one field.
+ */
+typedef void (*time_encoder)(struct token_bits *token, long int timestamp, int method);
+
+#define TIME_ENCODER(name, type, size) \
+	static void name(struct token_bits *token, long int timestamp, int method) \
+	{ \
+		put_bits( \
+			token, \
+			(type) | \
+			(((uint64_t)timestamp & ((1ULL << (size)) - 1)) << TIME_TYPE_SIZE) | \
+			((uint64_t)(method & ((1 << METHOD_SIZE) - 1)) << (TIME_TYPE_SIZE + (size))), \
+			TIME_TYPE_SIZE + (size) + METHOD_SIZE); \
+	}
+
+TIME_ENCODER(encode_time_s, TIME_S, TIME_S_SIZE)
+TIME_ENCODER(encode_time_us, TIME_US, TIME_US_SIZE)
+
+static const time_encoder time_encoders[2] =
+{
+	[TIME_S] = encode_time_s,
+	[TIME_US] = encode_time_us,
+};
+
+/*
+ * Generic id encoders, indexed by which of id1 (bit 0) and id2 (bit 1) are set
+ */
+typedef void (*ids_encoder)(struct token_bits *token, int id1, int id2);
+
+#define IDS_ENCODER(name, with_id1, with_id2) \
+	static void name(struct token_bits *token, int id1, int id2) \
+	{ \
+		uint64_t id1_bits = (with_id1) ? 1 | ((uint64_t)(id1 & ((1 << ID1_SIZE) - 1)) << 1) : 0; \
+		uint64_t id2_bits = (with_id2) ? 1 | ((uint64_t)(id2 & ((1 << ID2_SIZE) - 1)) << 1) : 0; \
+		unsigned int id1_size = (with_id1) ? 1 + ID1_SIZE : 1; \
+		put_bits(token, id1_bits | (id2_bits << id1_size), id1_size + ((with_id2) ? 1 + ID2_SIZE : 1)); \
+	}
+
+IDS_ENCODER(encode_no_ids, 0, 0)
+IDS_ENCODER(encode_id1, 1, 0)
+IDS_ENCODER(encode_id2, 0, 1)
+IDS_ENCODER(encode_ids, 1, 1)
+
+static const ids_encoder ids_encoders[4] =
+{
+	encode_no_ids,
+	encode_id1,
+	encode_id2,
+	encode_ids,
+};
+
+/**
+ * Add input address, and its port, to the given token
+ *
+ * @param struct token_bits* token The token to add the address to
+ * @param short int enabled Whether the address is enabled or not
+ * @param short int protocol The protocol used by the address (AF_INET or AF_INET6)
+ * @param void* ip The IP address to add, represented as a struct in_addr or struct in6_addr depending on the protocol
+ * @param short int port The port to add, or 0 for none
+ *
+ * @return void
+ */
+void add_address(
+	struct token_bits *token,
+	short int enabled,
+	short int protocol,
+	void* ip,
+	short int port
+)
+{
+	address_encoders[ADDRESS_KIND(enabled, protocol, port)](token, ip, (unsigned short)port);
+}
+
+/**
+ * Add a load balancer or web server address, and its port, to the given token
+ *
+ * Addresses in the dictionary are written as their index. Client addresses
+ * never are, so they go through add_address() and skip the lookup.
+ *
+ * @param struct token_bits* token The token to add the address to
+ * @param short int enabled Whether the address is enabled or not
+ * @param short int protocol The protocol used by the address (AF_INET or AF_INET6)
+ * @param void* ip The IP address to add, represented as a struct in_addr or struct in6_addr depending on the protocol
+ * @param short int port The port to add, or 0 for none
+ *
+ * @return void
+ */
+static void add_server_address(
+	struct token_bits *token,
+	short int enabled,
+	short int protocol,
+	void* ip,
+	short int port
+)
+{
+	int known = -1;
+
+	if (enabled)
+	{
+		uint64_t high = 0, low;
+
+		if (protocol == AF_INET)
+		{
+			low = ntohl(((const struct in_addr *)ip)->s_addr);
+		}
+		else
+		{
+			split_ipv6(ip, &high, &low);
+		}
+
+		known = find_known_address(high, low, protocol);
+	}
+
+	if (known < 0)
+	{
+		add_address(token, enabled, protocol, ip, port);
+		return;
+	}
+
+	uint64_t with_port = (unsigned short)port != 0;
+
+	put_bits(
+		token,
+		COMPACT_HEADER(COMPACT_KNOWN) |
+		((uint64_t)known << COMPACT_HEADER_SIZE) |
+		(with_port << (COMPACT_HEADER_SIZE + DICTIONARY_INDEX_SIZE)) |
+		((uint64_t)(unsigned short)port << (COMPACT_HEADER_SIZE + DICTIONARY_INDEX_SIZE + 1)),
+		COMPACT_HEADER_SIZE + DICTIONARY_INDEX_SIZE + 1 + (with_port ? PORT_SIZE : 0));
+}
+
+/**
+ * Encode a load balancer or web server address segment, including its port, for later use
+ *
+ * @param struct token_segment* segment Where to store the segment
+ * @param short int enabled Whether the address is enabled or not
+ * @param short int protocol The protocol used by the address (AF_INET or AF_INET6)
+ * @param void* ip The IP address to add, represented as a struct in_addr or struct in6_addr depending on the protocol
+ * @param short int port The port to add, or 0 for none
+ *
+ * @return void
+ */
+void encode_segment(
+	struct token_segment *segment,
+	short int enabled,
+	short int protocol,
+	void* ip,
+	short int port
+)
+{
+	struct token_bits bits = { { 0 }, 0 };
+
+	add_server_address(&bits, enabled, protocol, ip, port);
+
+	memcpy(segment->word, bits.word, sizeof(segment->word));
+	segment->size = bits.size;
+}
+
+/**
+ * Splice a pre-encoded segment into the given token
+ *
+ * @param struct token_bits* token The token to add the segment to
+ * @param struct token_segment* segment The segment to add
+ *
+ * @return void
+ */
+static inline void add_segment(struct token_bits *token, const struct token_segment *segment)
+{
+	unsigned int size = segment->size;
+
+	// Bits above the size are always clear, so whole words can be copied
+	for (int i = 0; size; i++)
+	{
+		unsigned int part = size < 64 ? size : 64;
+		put_bits(token, segment->word[i], part);
+		size -= part;
+	}
+}
+
+/**
+ * Add the addresses and generic ids of the token data to the given token
+ *
+ * @param struct token_bits* token The token to add the data to
+ * @param struct token_data* data The token data to add
+ *
+ * @return void
+ */
+static void add_token_body(struct token_bits *token, struct token_data *data)
+{
+	// Client
+	add_address(token, data->client_enabled, data->client_protocol, (void *)&(data->client_ip), data->client_port);
+
+	// LB
+	if (data->lb_segment)
+	{
+		add_segment(token, data->lb_segment);
+	}
+	else
+	{
+		add_server_address(token, data->lb_enabled, data->lb_protocol, (void *)&(data->lb_ip), data->lb_port);
+	}
+
+	// Server
+	if (data->server_segment)
+	{
+		add_segment(token, data->server_segment);
+	}
+	else
+	{
+		add_server_address(token, data->server_enabled, data->server_protocol, (void *)&(data->server_ip), data->server_port);
+	}
+
+	// Add generic ids
+	ids_encoders[(data->id1 != 0) | ((data->id2 != 0) << 1)](token, data->id1, data->id2);
+}
+
+/**
+ * Add token data to the given token
+ *
+ * In the standard layout fields are written least significant first:
+ * version, timestamp, method, client, load balancer, server and finally the
+ * generic ids. The sortable layout writes the method and the rest in the low
+ * bits, and moves the version and timestamp to the top. Each segment is
+ * written by the encoder specialised for its shape.
+ *
+ * @param struct token_bits* token The token to add the data to
+ * @param struct token_data* data The token data to add
  *
  * @return void
  */
-void add_port(mpz_ptr token, short int port)
+void add_token_data(struct token_bits *token, struct token_data *data)
+{
+	if (data->layout == LAYOUT_SORTABLE)
+	{
+		put_bits(token, data->method & ((1 << METHOD_SIZE) - 1), METHOD_SIZE);
+
+		add_token_body(token, data);
+
+		// Timestamp, time type, version and marker bit, at a fixed offset
+		token->size = SORTABLE_HEAD_OFFSET;
+		put_bits(token, (uint64_t)data->timestamp & ((1ULL << TIME_US_SIZE) - 1), TIME_US_SIZE);
+		put_bits(
+			token,
+			(data->time_type != 0) |
+			(VERSION_BITS << TIME_TYPE_SIZE) |
+			(1 << (TIME_TYPE_SIZE + VERSION_SIZE)),
+			SORTABLE_HEAD_SIZE - TIME_US_SIZE);
+		return;
+	}
+
+	// Add version
+	put_bits(token, VERSION_BITS, VERSION_SIZE);
+
+	// Add timestamp and method
+	time_encoders[data->time_type != 0](token, data->timestamp, data->method);
+
+	add_token_body(token, data);
+}
+
+/**
+ * Read a field from the given token
+ *
+ * @param struct token_bits* token The token to read from
+ * @param unsigned int* offset The bit offset of the field, advanced past it
+ * @param unsigned int size The width of the field in bits (at most 64)
+ *
+ * @return uint64_t The value of the field
+ */
+static inline uint64_t get_bits(const struct token_bits *token, unsigned int *offset, unsigned int size)
 {
-	if (!port)
+	unsigned int index = *offset >> 6;
+	unsigned int shift = *offset & 63;
+
+	uint64_t value = (token->word[index] >> shift) | ((token->word[index + 1] << 1) << (63 - shift));
+
+	*offset += size;
+
+	return size < 64 ? value & ((1ULL << size) - 1) : value;
+}
+
+/**
+ * Read an address written by put_ipv6() or add_server_address(), after its protocol bit
+ *
+ * @param struct token_bits* token The token to read from
+ * @param unsigned int* offset The bit offset of the compact bit, advanced past the address
+ * @param short int compact Whether there is a compact bit (0 for Dtoken 0.1.0 tokens, which store the address in full)
+ * @param uint64_t* high Where to store the most significant half of the address
+ * @param uint64_t* low Where to store the least significant half of the address
+ *
+ * @return short int The protocol of the address, AF_INET only for known IPv4 addresses
+ */
+static inline short int read_ipv6(const struct token_bits *token, unsigned int *offset, short int compact, uint64_t *high, uint64_t *low)
+{
+	if (!compact || !get_bits(token, offset, 1))
+	{
+		*low = get_bits(token, offset, 64);
+		*high = get_bits(token, offset, 64);
+		return AF_INET6;
+	}
+
+	*high = 0;
+	*low = 0;
+
+	switch (get_bits(token, offset, COMPACT_KIND_SIZE))
+	{
+		case COMPACT_MAPPED:
+			*low = 0xffff00000000ULL | get_bits(token, offset, IPv4_SIZE);
+			break;
+
+		case COMPACT_PREFIX:
+		{
+			const struct ipv6_prefix* prefix = &ipv6_prefixes[get_bits(token, offset, PREFIX_INDEX_SIZE)];
+			unsigned int suffix = IPv6_SIZE - prefix->length;
+
+			*high = prefix->high;
+			*low = prefix->low;
+
+			if (suffix > 64)
+			{
+				*low = get_bits(token, offset, 64);
+				*high |= get_bits(token, offset, suffix - 64);
+			}
+			else
+			{
+				*low |= get_bits(token, offset, suffix);
+			}
+			break;
+		}
+
+		case COMPACT_KNOWN:
+		{
+			const struct known_address* known = &known_addresses[get_bits(token, offset, DICTIONARY_INDEX_SIZE)];
+
+			*high = known->high;
+			*low = known->low;
+			return known->protocol;
+		}
+	}
+
+	return AF_INET6;
+}
+
+/**
+ * Read an address segment, including its port, from the given token
+ *
+ * @param struct token_bits* token The token to read from
+ * @param unsigned int* offset The bit offset of the segment, advanced past it
+ * @param short int compact Whether IPv6 addresses start with the compact bit (see struct token_index)
+ * @param short int* enabled Where to store whether the address is included
+ * @param short int* protocol Where to store the protocol (AF_INET or AF_INET6)
+ * @param void* ip Where to store the address, as a struct in_addr or struct in6_addr
+ * @param short int* port Where to store the port, 0 if none
+ *
+ * @return void
+ */
+static void read_address(
+	const struct token_bits *token,
+	unsigned int *offset,
+	short int compact,
+	short int* enabled,
+	short int* protocol,
+	void* ip,
+	short int* port
+)
+{
+	*enabled = get_bits(token, offset, 1);
+	*protocol = AF_INET;
+	*port = 0;
+
+	if (!*enabled)
+	{
+		return;
+	}
+
+	if (get_bits(token, offset, 1) == INET4)
+	{
+		((struct in_addr *)ip)->s_addr = htonl(get_bits(token, offset, IPv4_SIZE));
+	}
+	else
+	{
+		unsigned char* bytes = ((struct in6_addr *)ip)->s6_addr;
+		uint64_t high, low;
+
+		*protocol = read_ipv6(token, offset, compact, &high, &low);
+
+		if (*protocol == AF_INET)
+		{
+			((struct in_addr *)ip)->s_addr = htonl(low);
+		}
+		else
+		{
+			for (int i = 7; i >= 0; i--)
+			{
+				bytes[i] = high;
+				bytes[i + 8] = low;
+				high >>= 8;
+				low >>= 8;
+			}
+		}
+	}
+
+	if (get_bits(token, offset, 1))
+	{
+		*port = get_bits(token, offset, PORT_SIZE);
+	}
+}
+
+/**
+ * Check that a range of bits in the given token is all zero
+ *
+ * @param struct token_bits* token The token to check
+ * @param unsigned int from The first bit of the range
+ * @param unsigned int to The bit after the end of the range
+ *
+ * @return int 1 if no bit in the range is set, 0 otherwise
+ */
+static int bits_clear(const struct token_bits *token, unsigned int from, unsigned int to)
+{
+	while (from < to)
+	{
+		unsigned int offset = from;
+		unsigned int size = 64 - (from & 63);
+
+		if (size > to - from)
+		{
+			size = to - from;
+		}
+
+		if (get_bits(token, &offset, size))
+		{
+			return 0;
+		}
+
+		from += size;
+	}
+
+	return 1;
+}
+
+/**
+ * Skip an address segment, including its port
+ *
+ * @param struct token_bits* token The token to read from
+ * @param unsigned int* offset The bit offset of the segment, advanced past it
+ * @param short int compact Whether IPv6 addresses start with the compact bit (see struct token_index)
+ *
+ * @return int 0 on success, or -1 if the segment uses an unknown kind, prefix or dictionary address
+ */
+static inline int skip_address(const struct token_bits *token, unsigned int *offset, short int compact)
+{
+	if (!get_bits(token, offset, 1))
+	{
+		return 0;
+	}
+
+	if (get_bits(token, offset, 1) == INET4)
+	{
+		*offset += IPv4_SIZE;
+	}
+	else if (!compact || !get_bits(token, offset, 1))
+	{
+		*offset += IPv6_SIZE;
+	}
+	else
+	{
+		switch (get_bits(token, offset, COMPACT_KIND_SIZE))
+		{
+			case COMPACT_MAPPED:
+				*offset += IPv4_SIZE;
+				break;
+
+			case COMPACT_PREFIX:
+			{
+				unsigned int index = get_bits(token, offset, PREFIX_INDEX_SIZE);
+
+				if (index >= ipv6_prefix_count)
+				{
+					return -1;
+				}
+
+				*offset += IPv6_SIZE - ipv6_prefixes[index].length;
+				break;
+			}
+
+			case COMPACT_KNOWN:
+				if (get_bits(token, offset, DICTIONARY_INDEX_SIZE) >= known_address_count)
+				{
+					return -1;
+				}
+				break;
+
+			default:
+				return -1;
+		}
+	}
+
+	*offset += get_bits(token, offset, 1) ? PORT_SIZE : 0;
+
+	return 0;
+}
+
+/**
+ * Find the fields of the given token
+ *
+ * Only the flags saying which fields are included are read, so this is much
+ * cheaper than reading the whole token. Tokens from other versions of Dtoken
+ * than this one and 0.1.0, or with bits set outside of the fields, are
+ * rejected.
+ *
+ * @param struct token_index* index Where to store the offsets of the fields
+ * @param struct token_bits* token The token to index
+ *
+ * @return int 0 on success, or -1 if the token is not valid
+ */
+int index_token(struct token_index *index, const struct token_bits *token)
+{
+	unsigned int offset = SORTABLE_SIZE - 1;
+	unsigned int end = TOKEN_WORDS * 64;
+
+	// The marker bit is only set in the sortable layout
+	if (get_bits(token, &offset, 1))
+	{
+		index->layout = LAYOUT_SORTABLE;
+		index->compact = 1;
+
+		offset = SORTABLE_HEAD_OFFSET;
+		index->timestamp = offset;
+		offset += TIME_US_SIZE;
+		index->time_type = get_bits(token, &offset, TIME_TYPE_SIZE);
+
+		if (get_bits(token, &offset, VERSION_SIZE) != VERSION_BITS || !bits_clear(token, SORTABLE_SIZE, end))
+		{
+			return -1;
+		}
+
+		offset = 0;
+		end = SORTABLE_HEAD_OFFSET;
+	}
+	else
+	{
+		index->layout = LAYOUT_STANDARD;
+
+		offset = 0;
+		switch (get_bits(token, &offset, VERSION_SIZE))
+		{
+			case VERSION_BITS:
+				index->compact = 1;
+				break;
+
+			case VERSION_0_1_0_BITS:
+				index->compact = 0;
+				break;
+
+			default:
+				return -1;
+		}
+
+		index->time_type = get_bits(token, &offset, TIME_TYPE_SIZE);
+		index->timestamp = offset;
+		offset += index->time_type == TIME_S ? TIME_S_SIZE : TIME_US_SIZE;
+	}
+
+	index->method = offset;
+	offset += METHOD_SIZE;
+
+	index->client = offset;
+	if (skip_address(token, &offset, index->compact) != 0)
+	{
+		return -1;
+	}
+
+	index->lb = offset;
+	if (skip_address(token, &offset, index->compact) != 0)
+	{
+		return -1;
+	}
+
+	index->server = offset;
+	if (skip_address(token, &offset, index->compact) != 0)
+	{
+		return -1;
+	}
+
+	index->id1 = offset;
+	offset += get_bits(token, &offset, 1) ? ID1_SIZE : 0;
+
+	index->id2 = offset;
+	offset += get_bits(token, &offset, 1) ? ID2_SIZE : 0;
+
+	// Nothing may follow the last field
+	return bits_clear(token, offset, end) ? 0 : -1;
+}
+
+/**
+ * Read the timestamp of an indexed token
+ *
+ * @param struct token_bits* token The token to read from
+ * @param struct token_index* index The offsets of its fields
+ *
+ * @return long int The timestamp, in seconds or microseconds depending on the time type
+ */
+long int read_token_timestamp(const struct token_bits *token, const struct token_index *index)
+{
+	unsigned int offset = index->timestamp;
+	unsigned int size = index->layout == LAYOUT_SORTABLE || index->time_type != TIME_S ? TIME_US_SIZE : TIME_S_SIZE;
+
+	return get_bits(token, &offset, size);
+}
+
+/**
+ * Read the HTTP method of an indexed token
+ *
+ * @param struct token_bits* token The token to read from
+ * @param struct token_index* index The offsets of its fields
+ *
+ * @return int The HTTP method, 0 if unknown
+ */
+int read_token_method(const struct token_bits *token, const struct token_index *index)
+{
+	unsigned int offset = index->method;
+
+	return get_bits(token, &offset, METHOD_SIZE);
+}
+
+/**
+ * Read an address segment of an indexed token
+ *
+ * @param struct token_bits* token The token to read from
+ * @param struct token_index* index The offsets of its fields
+ * @param unsigned int offset The offset of the segment (client, lb or server of the index)
+ * @param short int* enabled Where to store whether the address is included
+ * @param short int* protocol Where to store the protocol (AF_INET or AF_INET6)
+ * @param void* ip Where to store the address, as a struct in_addr or struct in6_addr
+ * @param short int* port Where to store the port, 0 if none
+ *
+ * @return void
+ */
+void read_token_address(
+	const struct token_bits *token,
+	const struct token_index *index,
+	unsigned int offset,
+	short int* enabled,
+	short int* protocol,
+	void* ip,
+	short int* port
+)
+{
+	read_address(token, &offset, index->compact, enabled, protocol, ip, port);
+}
+
+/**
+ * Read a generic id of an indexed token
+ *
+ * @param struct token_bits* token The token to read from
+ * @param unsigned int offset The offset of the id (id1 or id2 of the index)
+ * @param unsigned int size The width of the id (ID1_SIZE or ID2_SIZE)
+ *
+ * @return int The id, 0 if not included
+ */
+int read_token_id(const struct token_bits *token, unsigned int offset, unsigned int size)
+{
+	return get_bits(token, &offset, 1) ? (int)get_bits(token, &offset, size) : 0;
+}
+
+/**
+ * Read token data from the given token
+ *
+ * This is the reverse of add_token_data(), for either layout. Tokens from
+ * other versions of Dtoken than this one and 0.1.0, or with bits set outside
+ * of the fields, are rejected.
+ *
+ * @param struct token_data* data Where to store the token data
+ * @param struct token_bits* token The token to read
+ *
+ * @return int 0 on success, or -1 if the token is not valid
+ */
+int read_token_data(struct token_data *data, const struct token_bits *token)
+{
+	struct token_index index;
+
+	data->lb_segment = NULL;
+	data->server_segment = NULL;
+
+	if (index_token(&index, token) != 0)
+	{
+		return -1;
+	}
+
+	data->layout = index.layout;
+	data->time_type = index.time_type;
+	data->timestamp = read_token_timestamp(token, &index);
+	data->method = read_token_method(token, &index);
+
+	read_address(token, &index.client, index.compact, &data->client_enabled, &data->client_protocol, &data->client_ip, &data->client_port);
+	read_address(token, &index.lb, index.compact, &data->lb_enabled, &data->lb_protocol, &data->lb_ip, &data->lb_port);
+	read_address(token, &index.server, index.compact, &data->server_enabled, &data->server_protocol, &data->server_ip, &data->server_port);
+
+	data->id1 = read_token_id(token, index.id1, ID1_SIZE);
+	data->id2 = read_token_id(token, index.id2, ID2_SIZE);
+
+	return 0;
+}
+
+/**
+ * Multiply two words into a two word product
+ *
+ * Uses the compiler's 128-bit integers where there are any, and 32-bit
+ * halves otherwise (32-bit targets).
+ *
+ * @param uint64_t a The first factor
+ * @param uint64_t b The second factor
+ * @param uint64_t* high Where to store the high word of the product
+ *
+ * @return uint64_t The low word of the product
+ */
+static inline uint64_t multiply_words(uint64_t a, uint64_t b, uint64_t *high)
+{
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 product = (unsigned __int128)a * b;
+
+	*high = (uint64_t)(product >> 64);
+	return (uint64_t)product;
+#else
+	uint64_t low = (a & 0xffffffff) * (b & 0xffffffff);
+	uint64_t middle = (a >> 32) * (b & 0xffffffff) + (low >> 32);
+	uint64_t other = (a & 0xffffffff) * (b >> 32) + (middle & 0xffffffff);
+
+	*high = (a >> 32) * (b >> 32) + (middle >> 32) + (other >> 32);
+	return (other << 32) | (low & 0xffffffff);
+#endif
+}
+
+/**
+ * Divide a two word number by the normalised base 36 chunk
+ *
+ * Uses multiplication by the precomputed reciprocal instead of a hardware
+ * division (Möller and Granlund, "Improved division by invariant integers").
+ *
+ * @param uint64_t* remainder Where to store the remainder (still normalised)
+ * @param uint64_t high The high word, which must be less than BASE36_CHUNK_NORM
+ * @param uint64_t low The low word
+ *
+ * @return uint64_t The quotient
+ */
+static inline uint64_t divide_chunk(uint64_t *remainder, uint64_t high, uint64_t low)
+{
+	// product = BASE36_CHUNK_INV * high + (high << 64 | low)
+	uint64_t product_high;
+	uint64_t product = multiply_words(BASE36_CHUNK_INV, high, &product_high) + low;
+	product_high += high + (product < low);
+
+	uint64_t quotient = product_high + 1;
+	uint64_t rest = low - quotient * BASE36_CHUNK_NORM;
+
+	// The estimate is at most one off in either direction
+	if (rest > product)
+	{
+		quotient--;
+		rest += BASE36_CHUNK_NORM;
+	}
+	if (rest >= BASE36_CHUNK_NORM)
+	{
+		quotient++;
+		rest -= BASE36_CHUNK_NORM;
+	}
+
+	*remainder = rest;
+	return quotient;
+}
+
+/**
+ * Write the given token to a buffer as a base 36 string
+ *
+ * The token is repeatedly divided by 36^12, and each 64-bit remainder is then
+ * expanded into 12 digits with native (constant divisor) arithmetic.
+ *
+ * @param char* buffer The buffer to write to, at least BASE36_MAX_LENGTH + 1 bytes
+ * @param struct token_bits* token The token to encode
+ * @param size_t width The minimum length of the string, left padded with '0' (0 for none)
+ *
+ * @return size_t The length of the string written, excluding the NUL
+ */
+size_t encode_base36(char* buffer, const struct token_bits *token, size_t width)
+{
+	static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+
+	uint64_t value[TOKEN_WORDS];
+	uint64_t chunk[BASE36_CHUNKS];
+	int words = TOKEN_WORDS;
+	int chunks = 0;
+	int i;
+
+	memcpy(value, token->word, sizeof(value));
+
+	while (words > 0 && !value[words - 1])
+	{
+		words--;
+	}
+
+	// Peel off chunks of 12 digits, least significant first
+	while (words > 0)
+	{
+		uint64_t remainder = value[words - 1] >> (64 - BASE36_CHUNK_SHIFT);
+
+		for (i = words - 1; i >= 0; i--)
+		{
+			uint64_t low = value[i] << BASE36_CHUNK_SHIFT;
+			if (i > 0)
+			{
+				low |= value[i - 1] >> (64 - BASE36_CHUNK_SHIFT);
+			}
+			value[i] = divide_chunk(&remainder, remainder, low);
+		}
+
+		chunk[chunks++] = remainder >> BASE36_CHUNK_SHIFT;
+
+		while (words > 0 && !value[words - 1])
+		{
+			words--;
+		}
+	}
+
+	// A zero token is still written as "0"
+	if (!chunks)
+	{
+		chunk[chunks++] = 0;
+	}
+
+	// Digits in the most significant chunk, without leading zeros
+	uint64_t top = chunk[chunks - 1];
+	int length = 1;
+	for (uint64_t rest = top / 36; rest; rest /= 36)
+	{
+		length++;
+	}
+
+	// Left pad with '0' up to the requested width
+	char* out = buffer;
+	size_t size = length + (size_t)(chunks - 1) * BASE36_CHUNK_DIGITS;
+	if (size < width)
+	{
+		memset(out, '0', width - size);
+		out += width - size;
+	}
+
+	for (i = length - 1; i >= 0; i--)
+	{
+		out[i] = digits[top % 36];
+		top /= 36;
+	}
+	out += length;
+
+	// Remaining chunks are always 12 digits wide
+	for (int c = chunks - 2; c >= 0; c--)
+	{
+		uint64_t rest = chunk[c];
+		for (i = BASE36_CHUNK_DIGITS - 1; i >= 0; i--)
+		{
+			out[i] = digits[rest % 36];
+			rest /= 36;
+		}
+		out += BASE36_CHUNK_DIGITS;
+	}
+
+	*out = '\0';
+
+	return out - buffer;
+}
+
+/*
+ * Base 36 digit mapping
+ *
+ * Each mapper turns BASE36_DECODE_BUFFER characters into digit values and
+ * returns non-zero if any of them is not a base 36 character. Validity is
+ * accumulated across the whole buffer and checked once at the end, so there
+ * is no branch per character.
+ */
+typedef int (*digit_mapper)(unsigned char* digits, const char* chars);
+
+static int map_digits_scalar(unsigned char* digits, const char* chars)
+{
+	unsigned int invalid = 0;
+
+	for (int i = 0; i < BASE36_DECODE_BUFFER; i++)
+	{
+		unsigned char c = chars[i];
+		unsigned char lower = c | 0x20;
+		unsigned int is_digit = (unsigned char)(c - '0') < 10;
+		unsigned int is_alpha = (unsigned char)(lower - 'a') < 26;
+
+		digits[i] = is_digit ? c - '0' : lower - 'a' + 10;
+		invalid |= !(is_digit | is_alpha);
+	}
+
+	return invalid;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.1")))
+static int map_digits_sse41(unsigned char* digits, const char* chars)
+{
+	const __m128i case_bit = _mm_set1_epi8(0x20);
+	__m128i valid = _mm_set1_epi8(-1);
+
+	for (int i = 0; i < BASE36_DECODE_BUFFER; i += 16)
+	{
+		__m128i c = _mm_loadu_si128((const __m128i *)(chars + i));
+		__m128i lower = _mm_or_si128(c, case_bit);
+
+		// Bytes of 0x80 and above are negative, so fail both ranges
+		__m128i is_digit = _mm_and_si128(
+			_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+			_mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), c));
+		__m128i is_alpha = _mm_and_si128(
+			_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+			_mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), lower));
+
+		__m128i digit = _mm_blendv_epi8(
+			_mm_sub_epi8(lower, _mm_set1_epi8('a' - 10)),
+			_mm_sub_epi8(c, _mm_set1_epi8('0')),
+			is_digit);
+
+		_mm_storeu_si128((__m128i *)(digits + i), digit);
+		valid = _mm_and_si128(valid, _mm_or_si128(is_digit, is_alpha));
+	}
+
+	return _mm_movemask_epi8(valid) != 0xFFFF;
+}
+
+__attribute__((target("avx2")))
+static int map_digits_avx2(unsigned char* digits, const char* chars)
+{
+	const __m256i case_bit = _mm256_set1_epi8(0x20);
+	__m256i valid = _mm256_set1_epi8(-1);
+
+	for (int i = 0; i < BASE36_DECODE_BUFFER; i += 32)
+	{
+		__m256i c = _mm256_loadu_si256((const __m256i *)(chars + i));
+		__m256i lower = _mm256_or_si256(c, case_bit);
+
+		// Bytes of 0x80 and above are negative, so fail both ranges
+		__m256i is_digit = _mm256_and_si256(
+			_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+			_mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+		__m256i is_alpha = _mm256_and_si256(
+			_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+			_mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+
+		__m256i digit = _mm256_blendv_epi8(
+			_mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10)),
+			_mm256_sub_epi8(c, _mm256_set1_epi8('0')),
+			is_digit);
+
+		_mm256_storeu_si256((__m256i *)(digits + i), digit);
+		valid = _mm256_and_si256(valid, _mm256_or_si256(is_digit, is_alpha));
+	}
+
+	return _mm256_movemask_epi8(valid) != -1;
+}
+#endif
+
+/**
+ * Map base 36 characters to digit values with the best kernel for this CPU
+ *
+ * @param unsigned char* digits Where to store the digit values
+ * @param char* chars The characters, BASE36_DECODE_BUFFER of them
+ *
+ * @return int 0 if every character is a base 36 digit, non-zero otherwise
+ */
+static int map_digits(unsigned char* digits, const char* chars)
+{
+	static digit_mapper mapper = NULL;
+
+	if (!mapper)
+	{
+		digit_mapper selected = map_digits_scalar;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+		{
+			selected = map_digits_avx2;
+		}
+		else if (__builtin_cpu_supports("sse4.1"))
+		{
+			selected = map_digits_sse41;
+		}
+#endif
+
+		mapper = selected;
+	}
+
+	return mapper(digits, chars);
+}
+
+/**
+ * Combine 8 digit values into a number with SWAR multiply-add steps
+ *
+ * Neighbouring digits are merged in pairs, then fours, then eights, each
+ * step working on every lane of the 64-bit word at once.
+ *
+ * @param unsigned char* digits The digits, most significant first
+ *
+ * @return uint64_t The value of the digits
+ */
+static inline uint64_t combine_digits8(const unsigned char* digits)
+{
+	uint64_t v = 0;
+
+	// Little endian load, so the most significant digit is in the low byte
+	for (int i = 7; i >= 0; i--)
+	{
+		v = (v << 8) | digits[i];
+	}
+
+	v = (v & 0x00FF00FF00FF00FFULL) * 36 + ((v >> 8) & 0x00FF00FF00FF00FFULL);
+	v = (v & 0x0000FFFF0000FFFFULL) * 1296 + ((v >> 16) & 0x0000FFFF0000FFFFULL);
+
+	return (v & 0xFFFFFFFFULL) * 1679616 + (v >> 32);
+}
+
+/**
+ * Combine 4 digit values into a number with SWAR multiply-add steps
+ *
+ * @param unsigned char* digits The digits, most significant first
+ *
+ * @return uint64_t The value of the digits
+ */
+static inline uint64_t combine_digits4(const unsigned char* digits)
+{
+	uint32_t v = digits[0] | (digits[1] << 8) | (digits[2] << 16) | ((uint32_t)digits[3] << 24);
+
+	v = (v & 0x00FF00FF) * 36 + ((v >> 8) & 0x00FF00FF);
+
+	return (v & 0xFFFF) * 1296 + (v >> 16);
+}
+
+/**
+ * Read a base 36 string into the given token
+ *
+ * The string is right aligned in a buffer padded with '0', so it splits into
+ * whole chunks of 12 digits. The characters are mapped to digits (with SIMD
+ * where available), each chunk is combined with SWAR steps, and the chunks
+ * are then multiplied into the token. Both lower and upper case letters are
+ * accepted.
+ *
+ * @param struct token_bits* token The token to store the value in
+ * @param char* str The base 36 string
+ * @param size_t length The length of the string
+ *
+ * @return int 0 on success, or -1 if the string is not a valid token value
+ */
+int decode_base36(struct token_bits *token, const char* str, size_t length)
+{
+	char chars[BASE36_DECODE_BUFFER];
+	unsigned char digits[BASE36_DECODE_BUFFER];
+
+	memset(token, 0, sizeof(*token));
+
+	if (!length || length > BASE36_MAX_LENGTH)
+	{
+		return -1;
+	}
+
+	memset(chars, '0', sizeof(chars));
+	memcpy(chars + BASE36_DECODE_SIZE - length, str, length);
+
+	if (map_digits(digits, chars))
+	{
+		return -1;
+	}
+
+	// Skip the chunks that are only padding
+	for (int i = (BASE36_DECODE_SIZE - length) / BASE36_CHUNK_DIGITS * BASE36_CHUNK_DIGITS; i < BASE36_DECODE_SIZE; i += BASE36_CHUNK_DIGITS)
+	{
+		// token = token * 36^12 + chunk
+		uint64_t carry = combine_digits8(digits + i) * 1679616 + combine_digits4(digits + i + 8);
+
+		for (int w = 0; w < TOKEN_WORDS; w++)
+		{
+			uint64_t high;
+			uint64_t product = multiply_words(token->word[w], BASE36_CHUNK, &high) + carry;
+			token->word[w] = product;
+			carry = high + (product < carry);
+		}
+
+		if (carry)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Count the significant bits of the given token
+ *
+ * @param struct token_bits* token The token to measure
+ *
+ * @return unsigned int The position of the highest set bit plus one, or 0 for a zero token
+ */
+static unsigned int significant_bits(const struct token_bits *token)
+{
+	for (int i = TOKEN_WORDS - 1; i >= 0; i--)
+	{
+		if (token->word[i])
+		{
+			return i * 64 + 64 - __builtin_clzll(token->word[i]);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Write the given token to a buffer in a power of two base
+ *
+ * Each character holds the next group of bits, most significant first, so
+ * there is no division involved.
+ *
+ * @param char* buffer The buffer to write to
+ * @param struct token_bits* token The token to encode
+ * @param size_t width The minimum number of characters, left padded with zero digits
+ * @param unsigned int shift The number of bits per character
+ * @param char* alphabet The character for each digit, or NULL to write the digits as bytes
+ *
+ * @return size_t The length of the string written, excluding the NUL
+ */
+static size_t encode_bits(
+	char* buffer,
+	const struct token_bits *token,
+	size_t width,
+	unsigned int shift,
+	const char* alphabet
+)
+{
+	size_t length = (significant_bits(token) + shift - 1) / shift;
+
+	if (!length)
+	{
+		length = 1;
+	}
+
+	if (length < width)
+	{
+		length = width;
+	}
+
+	for (size_t i = 0; i < length; i++)
+	{
+		unsigned int offset = (length - 1 - i) * shift;
+		uint64_t digit = get_bits(token, &offset, shift);
+
+		buffer[i] = alphabet ? alphabet[digit] : (char)digit;
+	}
+
+	buffer[length] = '\0';
+
+	return length;
+}
+
+/**
+ * Map a Crockford base 32 character to its value
+ *
+ * Letters are accepted in either case, and I, L and O are read as 1, 1 and 0.
+ *
+ * @param unsigned char c The character
+ *
+ * @return int The value of the character, or -1 if it is not valid
+ */
+static int base32_value(unsigned char c)
+{
+	static const signed char letters[26] =
+	{
+		10, 11, 12, 13, 14, 15, 16, 17, 1, 18, 19, 1, 20,
+		21, 0, 22, 23, 24, 25, 26, -1, 27, 28, 29, 30, 31
+	};
+
+	if (c >= '0' && c <= '9')
+	{
+		return c - '0';
+	}
+
+	c |= 0x20;
+	if (c >= 'a' && c <= 'z')
+	{
+		return letters[c - 'a'];
+	}
+
+	return -1;
+}
+
+/**
+ * Map a base 64 (URL and filename safe) character to its value
+ *
+ * @param unsigned char c The character
+ *
+ * @return int The value of the character, or -1 if it is not valid
+ */
+static int base64url_value(unsigned char c)
+{
+	if (c >= 'A' && c <= 'Z')
+	{
+		return c - 'A';
+	}
+	if (c >= 'a' && c <= 'z')
+	{
+		return c - 'a' + 26;
+	}
+	if (c >= '0' && c <= '9')
+	{
+		return c - '0' + 52;
+	}
+	if (c == '-')
+	{
+		return 62;
+	}
+	if (c == '_')
+	{
+		return 63;
+	}
+
+	return -1;
+}
+
+/**
+ * Read a token in a power of two base
+ *
+ * @param struct token_bits* token The token to store the value in
+ * @param char* str The encoded token
+ * @param size_t length The length of the encoded token
+ * @param unsigned int shift The number of bits per character
+ * @param int (*value)(unsigned char) Maps a character to its value, or NULL if characters are bytes
+ *
+ * @return int 0 on success, or -1 if the string is not a valid token value
+ */
+static int decode_bits(
+	struct token_bits *token,
+	const char* str,
+	size_t length,
+	unsigned int shift,
+	int (*value)(unsigned char)
+)
+{
+	memset(token, 0, sizeof(*token));
+
+	if (!length || length * shift > TOKEN_WORDS * 64)
+	{
+		return -1;
+	}
+
+	// Least significant character first
+	for (size_t i = length; i > 0; i--)
+	{
+		int digit = value ? value(str[i - 1]) : (unsigned char)str[i - 1];
+
+		if (digit < 0)
+		{
+			return -1;
+		}
+
+		put_bits(token, digit, shift);
+	}
+
+	return 0;
+}
+
+/*
+ * Output encoders, indexed by encoding and whether the output is fixed length
+ */
+#define OUTPUT_ENCODER(name, call) \
+	static size_t name(char* buffer, const struct token_bits *token) \
+	{ \
+		return call; \
+	}
+
+#define BASE32_ALPHABET "0123456789ABCDEFGHJKMNPQRSTVWXYZ"
+/* Not in ASCII order, so sortable base 64 tokens do not compare by time as strings */
+#define BASE64URL_ALPHABET "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"
+
+OUTPUT_ENCODER(encode_base36_token, encode_base36(buffer, token, 0))
+OUTPUT_ENCODER(encode_base36_fixed, encode_base36(buffer, token, BASE36_MAX_LENGTH))
+OUTPUT_ENCODER(encode_base32_token, encode_bits(buffer, token, 0, 5, BASE32_ALPHABET))
+OUTPUT_ENCODER(encode_base32_fixed, encode_bits(buffer, token, BASE32_MAX_LENGTH, 5, BASE32_ALPHABET))
+OUTPUT_ENCODER(encode_base64url_token, encode_bits(buffer, token, 0, 6, BASE64URL_ALPHABET))
+OUTPUT_ENCODER(encode_base64url_fixed, encode_bits(buffer, token, BASE64URL_MAX_LENGTH, 6, BASE64URL_ALPHABET))
+OUTPUT_ENCODER(encode_raw_token, encode_bits(buffer, token, 0, 8, NULL))
+OUTPUT_ENCODER(encode_raw_fixed, encode_bits(buffer, token, RAW_MAX_LENGTH, 8, NULL))
+
+static const token_encoder token_encoders[4][2] =
+{
+	[ENCODING_BASE36] = { encode_base36_token, encode_base36_fixed },
+	[ENCODING_BASE32] = { encode_base32_token, encode_base32_fixed },
+	[ENCODING_BASE64URL] = { encode_base64url_token, encode_base64url_fixed },
+	[ENCODING_RAW] = { encode_raw_token, encode_raw_fixed },
+};
+
+/**
+ * Get the function writing tokens in the given encoding
+ *
+ * @param int encoding The encoding to use (see ENCODING_* macros)
+ * @param int flags Output options (TOKEN_FIXED_LENGTH to pad to a fixed length)
+ *
+ * @return token_encoder The encoder, base 36 if the encoding is unknown
+ */
+token_encoder get_token_encoder(int encoding, int flags)
+{
+	if (encoding < ENCODING_BASE36 || encoding > ENCODING_RAW)
+	{
+		encoding = ENCODING_BASE36;
+	}
+
+	return token_encoders[encoding][(flags & TOKEN_FIXED_LENGTH) != 0];
+}
+
+/**
+ * Get the length of the string encode_token() writes for the given token
+ *
+ * The length comes from the highest set bit of the token, so it takes no
+ * more than a count of leading zeros. It is exact for base 32, base 64 and
+ * raw. For base 36 it is the length of the largest number with as many
+ * bits, which is the exact length for most tokens and one over for others.
+ *
+ * @param struct token_bits* token The token to encode
+ * @param int encoding The encoding to use (see ENCODING_* macros)
+ * @param int flags Output options (TOKEN_FIXED_LENGTH to pad to a fixed length)
+ *
+ * @return size_t The length of the string (at most one over for base 36), excluding the NUL
+ */
+size_t encoded_length(const struct token_bits *token, int encoding, int flags)
+{
+	// Fields written last, such as absent ids, can leave the top bits clear
+	size_t size = significant_bits(token);
+	size_t length, fixed;
+
+	switch (encoding)
+	{
+		case ENCODING_BASE32:
+			length = (size + 4) / 5;
+			fixed = BASE32_MAX_LENGTH;
+			break;
+
+		case ENCODING_BASE64URL:
+			length = (size + 5) / 6;
+			fixed = BASE64URL_MAX_LENGTH;
+			break;
+
+		case ENCODING_RAW:
+			length = (size + 7) / 8;
+			fixed = RAW_MAX_LENGTH;
+			break;
+
+		default:
+			// 12677 / 65536 is just above log36(2), so this is the length of
+			// the largest number of this many bits
+			length = size * 12677 / 65536 + 1;
+			fixed = BASE36_MAX_LENGTH;
+			break;
+	}
+
+	if (!length)
+	{
+		length = 1;
+	}
+
+	if ((flags & TOKEN_FIXED_LENGTH) && length < fixed)
+	{
+		length = fixed;
+	}
+
+	return length;
+}
+
+/**
+ * Write the given token to a buffer in the given encoding
+ *
+ * @param char* buffer The buffer to write to, at least TOKEN_MAX_LENGTH + 1 bytes
+ * @param struct token_bits* token The token to encode
+ * @param int encoding The encoding to use (see ENCODING_* macros)
+ * @param int flags Output options (TOKEN_FIXED_LENGTH to pad to a fixed length)
+ *
+ * @return size_t The length of the token written, excluding the NUL
+ */
+size_t encode_token(char* buffer, const struct token_bits *token, int encoding, int flags)
+{
+	return get_token_encoder(encoding, flags)(buffer, token);
+}
+
+/**
+ * Read a token in the given encoding
+ *
+ * @param struct token_bits* token The token to store the value in
+ * @param char* str The encoded token
+ * @param size_t length The length of the encoded token
+ * @param int encoding The encoding of the token (see ENCODING_* macros)
+ *
+ * @return int 0 on success, or -1 if the string is not a valid token value
+ */
+int decode_token(struct token_bits *token, const char* str, size_t length, int encoding)
+{
+	switch (encoding)
+	{
+		case ENCODING_BASE32:
+			return decode_bits(token, str, length, 5, base32_value);
+
+		case ENCODING_BASE64URL:
+			return decode_bits(token, str, length, 6, base64url_value);
+
+		case ENCODING_RAW:
+			return decode_bits(token, str, length, 8, NULL);
+
+		default:
+			return decode_base36(token, str, length);
+	}
+}
+
+/**
+ * Map a hexadecimal digit to its value
+ *
+ * @param unsigned char c The character
+ *
+ * @return int The value of the digit, or -1 if it is not valid
+ */
+static inline int hex_value(unsigned char c)
+{
+	if (c >= '0' && c <= '9')
+	{
+		return c - '0';
+	}
+
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+	{
+		return c - 'a' + 10;
+	}
+
+	return -1;
+}
+
+/**
+ * Read a dotted quad IPv4 address at the start of a string
+ *
+ * Like inet_pton(), exactly four decimal parts are required, each at most
+ * 255 and without leading zeros.
+ *
+ * @param struct in_addr* ip Where to store the address
+ * @param char* str The start of the address
+ * @param char* end The end of the string
+ *
+ * @return char* The first character after the address, or NULL if it is not valid
+ */
+static const char* parse_ipv4(struct in_addr *ip, const char* str, const char* end)
+{
+	unsigned char bytes[4];
+
+	for (int part = 0; part < 4; part++)
+	{
+		if (part)
+		{
+			if (str == end || *str != '.')
+			{
+				return NULL;
+			}
+			str++;
+		}
+
+		const char* digits = str;
+		unsigned int value = 0;
+
+		while (str < end && str - digits < 3 && *str >= '0' && *str <= '9')
+		{
+			value = value * 10 + (*str++ - '0');
+		}
+
+		if (str == digits || value > 255 || (*digits == '0' && str - digits > 1))
+		{
+			return NULL;
+		}
+
+		bytes[part] = value;
+	}
+
+	memcpy(ip, bytes, sizeof(bytes));
+
+	return str;
+}
+
+/**
+ * Read an IPv6 address at the start of a string
+ *
+ * Groups of up to four hexadecimal digits are written as they are read. A
+ * "::" gap is filled in by moving the groups after it to the end, and the
+ * last 32 bits can be written as a dotted quad.
+ *
+ * @param struct in6_addr* ip Where to store the address
+ * @param char* str The start of the address
+ * @param char* end The end of the string
+ *
+ * @return char* The first character after the address, or NULL if it is not valid
+ */
+static const char* parse_ipv6(struct in6_addr *ip, const char* str, const char* end)
+{
+	unsigned char bytes[16];
+	int count = 0;
+	int gap = -1;
+
+	if (end - str >= 2 && str[0] == ':' && str[1] == ':')
+	{
+		gap = 0;
+		str += 2;
+	}
+
+	// "::" may be the whole address
+	if (gap < 0 || (str < end && hex_value(*str) >= 0))
+	{
+		for (;;)
+		{
+			const char* group = str;
+			unsigned int value = 0;
+			int digit;
+
+			while (str < end && str - group < 4 && (digit = hex_value(*str)) >= 0)
+			{
+				value = value << 4 | digit;
+				str++;
+			}
+
+			if (str == group || count == 16)
+			{
+				return NULL;
+			}
+
+			// Dotted quad for the last 32 bits
+			if (str < end && *str == '.')
+			{
+				struct in_addr v4;
+
+				if (count > 12 || (str = parse_ipv4(&v4, group, end)) == NULL)
+				{
+					return NULL;
+				}
+
+				memcpy(bytes + count, &v4, sizeof(v4));
+				count += 4;
+				break;
+			}
+
+			bytes[count++] = value >> 8;
+			bytes[count++] = value & 0xff;
+
+			if (str == end || *str != ':')
+			{
+				break;
+			}
+			str++;
+
+			if (str < end && *str == ':')
+			{
+				if (gap >= 0)
+				{
+					return NULL;
+				}
+
+				gap = count;
+				str++;
+
+				if (str == end || hex_value(*str) < 0)
+				{
+					break;
+				}
+			}
+		}
+	}
+
+	if (gap >= 0)
+	{
+		// The gap stands for at least one group
+		if (count == 16)
+		{
+			return NULL;
+		}
+
+		memmove(bytes + 16 - (count - gap), bytes + gap, count - gap);
+		memset(bytes + gap, 0, 16 - count);
+	}
+	else if (count != 16)
+	{
+		return NULL;
+	}
+
+	memcpy(ip, bytes, sizeof(bytes));
+
+	return str;
+}
+
+/**
+ * Read a decimal port number making up the rest of a string
+ *
+ * @param unsigned short int* port Where to store the port
+ * @param char* str The start of the port
+ * @param char* end The end of the string
+ *
+ * @return int 0 on success, or -1 if it is not a port from 1 to 65535
+ */
+static int parse_port(unsigned short int *port, const char* str, const char* end)
+{
+	unsigned int value = 0;
+
+	if (str == end || end - str > 5)
 	{
-		// Disabled bit
-		mpz_mul_2exp(token, token, 1);
-		mpz_add_ui(token, token, 0);
-		return;
+		return -1;
+	}
+
+	for (; str < end; str++)
+	{
+		if (*str < '0' || *str > '9')
+		{
+			return -1;
+		}
+
+		value = value * 10 + (*str - '0');
+	}
+
+	if (value == 0 || value > 65535)
+	{
+		return -1;
 	}
 
-	mpz_mul_2exp(token, token, PORT_SIZE);
-	mpz_add_ui(token, token, port);
+	*port = value;
 
-	// Enabled bit
-	mpz_mul_2exp(token, token, 1);
-	mpz_add_ui(token, token, 1);
+	return 0;
 }
 
 /**
- * Add input address to the given token
+ * Read an IP address, optionally followed by a port, in a single scan
  *
- * @param mpz_t* token The token to add the address to
- * @param short int enabled Whether the address is enabled or not
- * @param short int protocol The protocol used by the address (AF_INET or AF_INET6)
- * @param void* ip The IP address to add, represented as a struct in_addr or struct in6_addr depending on the protocol
+ * The address is written as it is read; the only lookahead is the first few
+ * characters, to tell IPv4 from IPv6. A port needs brackets around an IPv6
+ * address, as in "[2001:db8::1]:443".
  *
- * @return void
+ * @param struct token_address* address Where to store the address and port
+ * @param char* str The address string, not necessarily NUL terminated
+ * @param size_t length The length of the string
+ *
+ * @return int 0 on success, or -1 if the string is not a valid address
  */
-void add_address(
-	mpz_ptr token,
-	short int enabled,
-	short int protocol,
-	void* ip
-)
+int parse_address(struct token_address *address, const char* str, size_t length)
 {
-//union { struct in_addr v4; struct in6_addr v6; }* ip = (union { struct in_addr v4; struct in6_addr v6; }*) ipa;
+	const char* end = str + length;
 
+	address->port = 0;
 
-	if (!enabled)
+	if (str < end && *str == '[')
 	{
-		mpz_mul_2exp(token, token, 1); // 1 bit for status
-		mpz_add_ui(token, token, 0); // 0 for disabled (implicit)
-		return;
+		// [IPv6] or [IPv6]:port
+		str = parse_ipv6(&address->ip.v6, str + 1, end);
+
+		if (str == NULL || str == end || *str != ']')
+		{
+			return -1;
+		}
+
+		address->protocol = AF_INET6;
+		str++;
+	}
+	else
+	{
+		// An IPv4 address has a '.' within its first four characters, where
+		// an IPv6 address has a ':' or is not valid anyway
+		const char* digits = str;
+
+		while (digits < end && digits - str < 4 && *digits >= '0' && *digits <= '9')
+		{
+			digits++;
+		}
+
+		if (digits == end || *digits != '.')
+		{
+			// Without brackets, a port cannot be told apart from a group
+			address->protocol = AF_INET6;
+			str = parse_ipv6(&address->ip.v6, str, end);
+
+			return str == end ? 0 : -1;
+		}
+
+		address->protocol = AF_INET;
+		str = parse_ipv4(&address->ip.v4, str, end);
+
+		if (str == NULL)
+		{
+			return -1;
+		}
 	}
 
-	if (protocol == AF_INET)
+	if (str == end)
 	{
-		union { struct in_addr v4; struct in6_addr v6; }* _ip = ip;
-		mpz_mul_2exp(token, token, IPv4_SIZE);
-		mpz_add_ui(token, token, ntohl((unsigned long)_ip->v4.s_addr));
+		return 0;
+	}
 
-		// Add protocol bit
-		mpz_mul_2exp(token, token, 1);
-		mpz_add_ui(token, token, INET4);
+	if (*str != ':')
+	{
+		return -1;
 	}
-	else // IPv6
+
+	return parse_port(&address->port, str + 1, end);
+}
+
+/**
+ * Set the IPv6 prefixes that are stored as an index instead of in full
+ *
+ * The index of a prefix is its position in the list. Bits of the address
+ * after the prefix length are ignored, and an empty list removes all the
+ * prefixes.
+ *
+ * @param char* list Comma separated prefixes (e.g. "2001:db8:1::/48, 2001:db8:2:3::/64")
+ * @param size_t length The length of the list
+ *
+ * @return int 0 on success, or -1 if the list is not valid (the prefixes are then left as they were)
+ */
+int set_ipv6_prefixes(const char* list, size_t length)
+{
+	struct ipv6_prefix prefixes[IPv6_PREFIXES] = { { 0 } };
+	unsigned int count = 0;
+	const char* end = list + length;
+
+	while (list < end)
 	{
-		union { struct in_addr v4; struct in6_addr v6; }* _ip = ip;
-		mpz_mul_2exp(token, token, IPv6_SIZE); // 128 bits reserved for method
+		const char* item = list;
+		const char* next = memchr(list, ',', end - list);
+		const char* stop = next ? next : end;
+
+		list = next ? next + 1 : end;
+
+		// Spaces are allowed around each prefix
+		while (item < stop && (*item == ' ' || *item == '\t'))
+		{
+			item++;
+		}
+		while (stop > item && (stop[-1] == ' ' || stop[-1] == '\t'))
+		{
+			stop--;
+		}
+
+		if (item == stop && !next && count == 0)
+		{
+			break;
+		}
+
+		struct in6_addr ip;
+		const char* slash = parse_ipv6(&ip, item, stop);
+		unsigned int bits = 0;
+
+		if (slash == NULL || slash == stop || *slash != '/' || stop - slash > 4 || count == IPv6_PREFIXES)
+		{
+			return -1;
+		}
 
-		// Import IPv6 address into temporary variable
-		mpz_t ipv6_addr;
-		mpz_init(ipv6_addr);
-		mpz_import(ipv6_addr, sizeof(_ip->v6.s6_addr), 1, sizeof(_ip->v6.s6_addr[0]), 0, 0, _ip->v6.s6_addr);
+		for (const char* digit = slash + 1; digit < stop; digit++)
+		{
+			if (*digit < '0' || *digit > '9')
+			{
+				return -1;
+			}
+			bits = bits * 10 + (*digit - '0');
+		}
 
-		// Add imported address to token
-		mpz_add(token, token, ipv6_addr);
+		if (stop - slash < 2 || bits < IPv6_PREFIX_MIN_LENGTH || bits > IPv6_SIZE)
+		{
+			return -1;
+		}
 
-		// Clear temporary variable
-		mpz_clear(ipv6_addr);
+		struct ipv6_prefix* prefix = &prefixes[count++];
 
-		// protocol bit
-		mpz_mul_2exp(token, token, 1);
-		mpz_add_ui(token, token, INET6);
+		prefix->length = bits;
+		prefix->high_mask = bits >= 64 ? ~0ULL : ~0ULL << (64 - bits);
+		prefix->low_mask = bits <= 64 ? 0 : bits == IPv6_SIZE ? ~0ULL : ~0ULL << (IPv6_SIZE - bits);
+
+		split_ipv6(&ip, &prefix->high, &prefix->low);
+		prefix->high &= prefix->high_mask;
+		prefix->low &= prefix->low_mask;
 	}
 
-	// Add enabled bit
-	mpz_mul_2exp(token, token, 1);
-	mpz_add_ui(token, token, 1);
+	memcpy(ipv6_prefixes, prefixes, sizeof(prefixes));
+	ipv6_prefix_count = count;
+
+	return 0;
 }
 
 /**
- * Add token data to the given token
+ * Place the addresses of a dictionary in a perfect hash table
  *
- * @param mpz_t* token The token to add the data to
- * @param struct token_data* data The token data to add
+ * Buckets are placed from the largest down, each with the first
+ * displacement that moves all of its addresses to free slots.
  *
- * @return void
+ * @param struct known_address* addresses The addresses to place
+ * @param unsigned int count The number of addresses
+ * @param uint64_t seed The seed of the hash
+ * @param unsigned int slot_mask The number of slots minus one
+ * @param unsigned int bucket_mask The number of buckets minus one
+ * @param uint16_t* slots Where to store the index + 1 of the address in each slot
+ * @param uint16_t* displacements Where to store the displacement of each bucket
+ *
+ * @return int 0 on success, or -1 if a bucket could not be placed with this seed
  */
-void add_token_data(mpz_ptr token, struct token_data *data)
+static int place_known_addresses(
+	const struct known_address* addresses,
+	unsigned int count,
+	uint64_t seed,
+	unsigned int slot_mask,
+	unsigned int bucket_mask,
+	uint16_t* slots,
+	uint16_t* displacements
+)
 {
-	// Add second generic id
-	if (!data->id2)
+	uint64_t hashes[DICTIONARY_ADDRESSES];
+	uint16_t members[DICTIONARY_ADDRESSES]; // addresses grouped by bucket
+	uint16_t starts[DICTIONARY_BUCKETS + 1] = { 0 };
+	uint16_t buckets[DICTIONARY_BUCKETS];
+	unsigned int bucket_count = bucket_mask + 1;
+
+	for (unsigned int i = 0; i < count; i++)
 	{
-		mpz_mul_2exp(token, token, 1);
-		mpz_add_ui(token, token, 0);
+		hashes[i] = hash_address(addresses[i].high, addresses[i].low, addresses[i].protocol, seed);
+		starts[((hashes[i] >> 40) & bucket_mask) + 1]++;
 	}
-	else
+	for (unsigned int i = 0; i < bucket_count; i++)
 	{
-		mpz_mul_2exp(token, token, ID2_SIZE);
-		mpz_add_ui(token, token, data->id2);
-		mpz_mul_2exp(token, token, 1);
-		mpz_add_ui(token, token, 1);
+		starts[i + 1] += starts[i];
+		buckets[i] = i;
 	}
-
-	// Add first generic id
-	if (!data->id1)
 	{
-		mpz_mul_2exp(token, token, 1);
-		mpz_add_ui(token, token, 0);
+		uint16_t next[DICTIONARY_BUCKETS];
+		memcpy(next, starts, sizeof(next));
+		for (unsigned int i = 0; i < count; i++)
+		{
+			members[next[(hashes[i] >> 40) & bucket_mask]++] = i;
+		}
 	}
-	else
+
+	// Largest buckets first, while most slots are still free
+	for (unsigned int i = 1; i < bucket_count; i++)
 	{
-		mpz_mul_2exp(token, token, ID1_SIZE);
-		mpz_add_ui(token, token, data->id1);
-		mpz_mul_2exp(token, token, 1);
-		mpz_add_ui(token, token, 1);
+		uint16_t bucket = buckets[i];
+		unsigned int size = starts[bucket + 1] - starts[bucket];
+		unsigned int j = i;
+
+		while (j > 0 && (unsigned int)(starts[buckets[j - 1] + 1] - starts[buckets[j - 1]]) < size)
+		{
+			buckets[j] = buckets[j - 1];
+			j--;
+		}
+		buckets[j] = bucket;
 	}
 
-	// Server
-	if (data->server_enabled)
+	memset(slots, 0, (slot_mask + 1) * sizeof(*slots));
+	memset(displacements, 0, bucket_count * sizeof(*displacements));
+
+	for (unsigned int i = 0; i < bucket_count; i++)
 	{
-		add_port(token, data->server_port);
+		unsigned int bucket = buckets[i];
+		unsigned int first = starts[bucket], last = starts[bucket + 1];
+		unsigned int displacement = 0;
+
+		if (first == last)
+		{
+			break;
+		}
+
+		for (; displacement <= UINT16_MAX; displacement++)
+		{
+			unsigned int placed = first;
+
+			for (; placed < last; placed++)
+			{
+				unsigned int slot = known_slot(hashes[members[placed]], displacement, slot_mask);
+
+				if (slots[slot])
+				{
+					break;
+				}
+				slots[slot] = members[placed] + 1;
+			}
+
+			if (placed == last)
+			{
+				break;
+			}
+
+			// Take back the slots of this attempt
+			while (placed-- > first)
+			{
+				slots[known_slot(hashes[members[placed]], displacement, slot_mask)] = 0;
+			}
+		}
+
+		if (displacement > UINT16_MAX)
+		{
+			return -1;
+		}
+		displacements[bucket] = displacement;
 	}
-	add_address(token, data->server_enabled, data->server_protocol, (void *)&(data->server_ip));
 
-	// LB
-	if (data->lb_enabled)
+	return 0;
+}
+
+/**
+ * Set the addresses that are stored as an index instead of in full
+ *
+ * The index of an address is its position in the list. Addresses cannot
+ * have a port, and an empty list removes all the addresses.
+ *
+ * @param char* list IPv4 or IPv6 addresses, separated by commas or white space, "#" starting a comment up to the end of the line
+ * @param size_t length The length of the list
+ *
+ * @return int 0 on success, or -1 if the list is not valid or holds an address twice (the dictionary is then left as it was)
+ */
+int set_address_dictionary(const char* list, size_t length)
+{
+	struct known_address addresses[DICTIONARY_ADDRESSES] = { { 0 } };
+	unsigned int count = 0;
+	const char* end = list + length;
+
+	while (list < end)
 	{
-		add_port(token, data->lb_port);
+		if (*list == '#')
+		{
+			const char* line = memchr(list, '\n', end - list);
+			list = line ? line + 1 : end;
+			continue;
+		}
+		if (*list == ',' || *list == ' ' || *list == '\t' || *list == '\r' || *list == '\n')
+		{
+			list++;
+			continue;
+		}
+
+		const char* item = list;
+		while (list < end && *list != ',' && *list != ' ' && *list != '\t' && *list != '\r' && *list != '\n' && *list != '#')
+		{
+			list++;
+		}
+
+		struct token_address address;
+		if (count == DICTIONARY_ADDRESSES || parse_address(&address, item, list - item) != 0 || address.port)
+		{
+			return -1;
+		}
+
+		struct known_address* known = &addresses[count++];
+
+		known->protocol = address.protocol;
+		if (address.protocol == AF_INET)
+		{
+			known->low = ntohl(address.ip.v4.s_addr);
+		}
+		else
+		{
+			split_ipv6(&address.ip.v6, &known->high, &known->low);
+		}
+
+		for (unsigned int i = 0; i < count - 1; i++)
+		{
+			if (addresses[i].high == known->high && addresses[i].low == known->low && addresses[i].protocol == known->protocol)
+			{
+				return -1;
+			}
+		}
 	}
-	add_address(token, data->lb_enabled, data->lb_protocol, (void *)&(data->lb_ip));
 
-	// Client
-	if (data->client_enabled)
+	// At most half of the slots are used, with a bucket for every 8 slots
+	unsigned int slots = 2;
+	while (slots < count * 2)
 	{
-		add_port(token, data->client_port);
+		slots *= 2;
 	}
-	add_address(token, data->client_enabled, data->client_protocol, (void *)&(data->client_ip));
+	unsigned int buckets = slots >= 8 ? slots / 8 : 1;
 
-	// Add method
-	mpz_mul_2exp(token, token, METHOD_SIZE); // 4 bits reserved for method
-	mpz_add_ui(token, token, data->method);
+	uint16_t table[DICTIONARY_SLOTS];
+	uint16_t displacements[DICTIONARY_BUCKETS];
+	uint64_t seed = 0;
+	int placed = -1;
 
-	// Add timestamp
-	if (data->time_type == 0)
+	for (unsigned int attempt = 0; attempt < 64 && placed != 0; attempt++)
 	{
-		// 32 bits for short timestamp
-		mpz_mul_2exp(token, token, TIME_S_SIZE);
-		// add timestamp
-		mpz_add_ui(token, token, data->timestamp);
-		// shift 1 bit left and leave bit zero for type seconds
-		mpz_mul_2exp(token, token, TIME_TYPE_SIZE);
-		// add 0 for type µs
-		mpz_add_ui(token, token, 0);
+		seed = mix_bits(0x9e3779b97f4a7c15ULL * (attempt + 1));
+		placed = place_known_addresses(addresses, count, seed, slots - 1, buckets - 1, table, displacements);
 	}
-	else
+
+	if (placed != 0)
 	{
-		// 32 bits for short timestamp
-		mpz_mul_2exp(token, token, TIME_US_SIZE);
-		// add timestamp
-		mpz_add_ui(token, token, data->timestamp);
-		// shift 1 bit left for time type bit
-		mpz_mul_2exp(token, token, TIME_TYPE_SIZE);
-		// add 1 for type µs
-		mpz_add_ui(token, token, 1);
+		return -1;
 	}
 
-	// add major version
-	mpz_mul_2exp(token, token, VERSION_MAJOR_SIZE);
-	mpz_add_ui(token, token, VERSION_MAJOR);
+	// Lookups check the count first, so it is cleared while the table changes
+	known_address_count = 0;
+	memcpy(known_addresses, addresses, sizeof(addresses));
+	memcpy(known_slots, table, slots * sizeof(*table));
+	memcpy(known_displacements, displacements, buckets * sizeof(*displacements));
+	known_seed = seed;
+	known_slot_mask = slots - 1;
+	known_bucket_mask = buckets - 1;
+	known_address_count = count;
+
+	return 0;
+}
+
+/**
+ * Builds a token from data that is already in binary form
+ *
+ * @param char* buffer The buffer to use for storing the token string, at least TOKEN_MAX_LENGTH + 1 bytes
+ * @param struct token_data* data The data to store, including the layout and both segment pointers
+ * @param int flags Output options (TOKEN_FIXED_LENGTH)
+ * @param int encoding The encoding of the token (see ENCODING_* macros)
+ *
+ * @return size_t The length of the built token
+ */
+size_t build_from_data(char* buffer, struct token_data *data, int flags, int encoding)
+{
+	struct token_bits bits = { { 0 }, 0 };
+
+	add_token_data(&bits, data);
+
+	// Convert to and store encoded value in buffer
+	return encode_token(buffer, &bits, encoding, flags);
+}
 
-	// add minor version
-	mpz_mul_2exp(token, token, VERSION_MINOR_SIZE);
-	mpz_add_ui(token, token, VERSION_MINOR);
+/**
+ * Copy a parsed address into the fields of token data
+ *
+ * @param short int* enabled Where to store whether the address is included
+ * @param short int* protocol Where to store the protocol
+ * @param void* ip Where to store the IP address
+ * @param short int* port Where to store the port
+ * @param struct token_address* address The address, or NULL for none
+ *
+ * @return void
+ */
+static void set_address(
+	short int* enabled,
+	short int* protocol,
+	void* ip,
+	short int* port,
+	const struct token_address *address)
+{
+	*enabled = address != NULL;
+	*protocol = AF_INET;
+	*port = 0;
 
-	// add path version
-	mpz_mul_2exp(token, token, VERSION_PATCH_SIZE);
-	mpz_add_ui(token, token, VERSION_PATCH);
+	if (address != NULL)
+	{
+		*protocol = address->protocol;
+		memcpy(ip, &address->ip, sizeof(address->ip));
+		*port = address->port;
+	}
 }
 
 /**
- * Builds a token using the given data and returns it as a base 36 encoded string
+ * Builds a token using the given data and stores it in the given encoding
  *
- * @param char* buffer The buffer to use for storing the token string
+ * @param char* buffer The buffer to use for storing the token string, at least TOKEN_MAX_LENGTH + 1 bytes
  * @param int method The method used to generate the token
  * @param _Bool time_type The precision of the timestamp (0 for seconds, 1 for microseconds)
  * @param long int timestamp The timestamp to add to the token
- * @param _Bool client_enabled Whether client information should be included in the token
- * @param short int client_protocol The protocol used by the client address (AF_INET or AF_INET6)
- * @param char* client_address The client IP address to include in the token
- * @param short int client_port The client port to include in the token
- * @param _Bool lb_enabled Whether load balancer information should be included in the token
- * @param short int lb_protocol The protocol used by the load balancer address (AF_INET or AF_INET6)
- * @param char* lb_address The load balancer IP address to include in the token
- * @param short int lb_port The load balancer port to include in the token
- * @param _Bool server_enabled Whether server information should be included in the token
- * @param short int server_protocol The protocol used by the server address (AF_INET or AF_INET6)
- * @param char* server_address The server IP address to include in the token
- * @param short int server_port The server port to include in the token
+ * @param struct token_address* client The client address and port, or NULL to leave it out
+ * @param struct token_address* lb The load balancer address and port, or NULL to leave it out
+ * @param struct token_address* server The server address and port, or NULL to leave it out
  * @param int id1 Some generic associated id to store in the token
  * @param int id2 Another generic associated id to store in the token
+ * @param int flags Output options (TOKEN_FIXED_LENGTH, TOKEN_SORTABLE)
+ * @param int encoding The encoding of the token (see ENCODING_* macros)
  *
- * @return char* The built token as a string
+ * @return size_t The length of the built token
  */
-char* build(
+size_t build(
 	char* buffer,
 	int method,
 	_Bool time_type,
 	long int timestamp,
-	_Bool client_enabled,
-	short int client_protocol,
-	char* client_address,
-	short int client_port,
-	_Bool lb_enabled,
-	short int lb_protocol,
-	char* lb_address,
-	short int lb_port,
-	_Bool server_enabled,
-	short int server_protocol,
-	char* server_address,
-	short int server_port,
+	const struct token_address *client,
+	const struct token_address *lb,
+	const struct token_address *server,
 	int id1,
-	int id2)
+	int id2,
+	int flags,
+	int encoding)
 {
 	struct token_data data;
 
+	data.layout = flags & TOKEN_SORTABLE ? LAYOUT_SORTABLE : LAYOUT_STANDARD;
 	data.time_type = time_type;
 	data.timestamp = timestamp;
 
 	data.method = method;
 
-	data.client_enabled = client_enabled;
-	data.client_protocol = client_protocol;
-	data.client_port = client_port;
-
-	data.lb_enabled = lb_enabled;
-	data.lb_protocol = lb_protocol;
-	data.lb_port = lb_port;
-
-	data.server_enabled = server_enabled;
-	data.server_protocol = server_protocol;
-	data.server_port = server_port;
+	set_address(&data.client_enabled, &data.client_protocol, &data.client_ip, &data.client_port, client);
+	set_address(&data.lb_enabled, &data.lb_protocol, &data.lb_ip, &data.lb_port, lb);
+	set_address(&data.server_enabled, &data.server_protocol, &data.server_ip, &data.server_port, server);
 
 	data.id1 = id1;
 	data.id2 = id2;
 
-	// client address
-	inet_pton(
-		client_protocol,
-		client_address,
-		client_protocol == AF_INET ?
-			(void *)&(data.client_ip.v4) :
-			(void *)&(data.client_ip.v6)
-	);
+	data.lb_segment = NULL;
+	data.server_segment = NULL;
 
-	// lb address
-	inet_pton(
-		lb_protocol,
-		lb_address,
-		lb_protocol == AF_INET ?
-			(void *)&(data.lb_ip.v4) :
-			(void *)&(data.lb_ip.v6)
-		);
-
-	// server address
-	inet_pton(
-		server_protocol,
-		server_address,
-		server_protocol == AF_INET ?
-			(void *)&(data.server_ip.v4) :
-			(void *)&(data.server_ip.v6)
-		);
+	return build_from_data(buffer, &data, flags, encoding);
+}
 
-	data.id1 = id1;
-	data.id2 = id2;
+/**
+ * Parses a token back into the data it was built from
+ *
+ * @param struct token_data* data Where to store the token data
+ * @param char* token The token to parse
+ * @param size_t length The length of the token
+ * @param int encoding The encoding of the token (see ENCODING_* macros)
+ *
+ * @return int 0 on success, or -1 if the token is not valid
+ */
+int parse(struct token_data *data, const char* token, size_t length, int encoding)
+{
+	struct token_bits bits;
+
+	if (decode_token(&bits, token, length, encoding) != 0)
+	{
+		return -1;
+	}
+
+	return read_token_data(data, &bits);
+}
+
+/**
+ * Converts a token from one encoding to another
+ *
+ * Every encoding holds the same number, so the conversion is lossless.
+ *
+ * @param char* buffer The buffer to store the converted token in, at least TOKEN_MAX_LENGTH + 1 bytes
+ * @param char* token The token to convert
+ * @param size_t length The length of the token
+ * @param int from The encoding of the token (see ENCODING_* macros)
+ * @param int to The encoding to convert to (see ENCODING_* macros)
+ * @param int flags Output options (TOKEN_FIXED_LENGTH to pad to a fixed length)
+ *
+ * @return size_t The length of the converted token, or 0 if the token is not valid
+ */
+size_t convert_token(char* buffer, const char* token, size_t length, int from, int to, int flags)
+{
+	struct token_bits bits;
+	struct token_data data;
+
+	if (decode_token(&bits, token, length, from) != 0 || read_token_data(&data, &bits) != 0)
+	{
+		return 0;
+	}
+
+	return encode_token(buffer, &bits, to, flags);
+}
 
-	mpz_t token;
-	mpz_init(token);
-	mpz_clear(token);
+/*
+ * Print the data contained in a token
+ *
+ * @param char* token The base 36 token to print
+ *
+ * @return int Returns 0 on success, or 1 if the token is not valid
+ */
+static int print_token(const char* token)
+{
+	static const char* methods[] =
+	{
+		"", "GET", "POST", "PUT", "DELETE", "HEAD", "CONNECT", "OPTIONS", "TRACE", "PATCH"
+	};
+
+	struct token_data data;
+	char client_address[INET6_ADDRSTRLEN];
+	char lb_address[INET6_ADDRSTRLEN];
+	char server_address[INET6_ADDRSTRLEN];
+
+	if (parse(&data, token, strlen(token), ENCODING_BASE36) != 0)
+	{
+		fprintf(stderr, "Invalid token.\n");
+		return 1;
+	}
+
+	inet_ntop(data.client_protocol, &data.client_ip, client_address, sizeof(client_address));
+	inet_ntop(data.lb_protocol, &data.lb_ip, lb_address, sizeof(lb_address));
+	inet_ntop(data.server_protocol, &data.server_ip, server_address, sizeof(server_address));
+
+	if (data.time_type == TIME_S)
+	{
+		printf("\033[1mTimestamp\033[0m: %ld\n", data.timestamp);
+	}
+	else
+	{
+		printf("\033[1mTimestamp\033[0m: %.6f\n", data.timestamp / 1000000.0);
+	}
+
+	if (data.method > 0 && data.method <= PATCH)
+	{
+		printf("\033[1mMethod\033[0m: %s\n", methods[data.method]);
+	}
+
+	PRINT_ADDRESS(data.client_enabled, "\033[1mClient\033[0m", client_address, (unsigned short)data.client_port);
+	PRINT_ADDRESS(data.lb_enabled, "\033[1mLoad balancer\033[0m", lb_address, (unsigned short)data.lb_port);
+	PRINT_ADDRESS(data.server_enabled, "\033[1mServer\033[0m", server_address, (unsigned short)data.server_port);
 
-	add_token_data(token, &data);
+	if (data.id1)
+	{
+		printf("\033[1mGeneric id 1\033[0m: %d\n", data.id1);
+	}
 
-	// Convert to and store base 36 value in buffer
-	char* token_str = mpz_get_str(NULL, 36, token);
-	strcpy(buffer, token_str);
-	free(token_str);
-	mpz_clear(token);
+	if (data.id2)
+	{
+		printf("\033[1mGeneric id 2\033[0m: %d\n", data.id2);
+	}
 
-	return buffer;
+	return 0;
 }
 
 /*
  * Command line tool for generating tokens using the dtoken extension
  *
+ * When a token is given as the first argument, its data is printed instead.
+ *
  * @return int Returns 0 on success, or 1 on failure
  */
-int main()
+int main(int argc, char** argv)
 {
+	// Tokens are built and read with the same IPv6 prefixes as the extension...
+	const char* prefixes = getenv("DTOKEN_IPV6_PREFIXES");
+	if (prefixes && set_ipv6_prefixes(prefixes, strlen(prefixes)) != 0)
+	{
+		fprintf(stderr, "DTOKEN_IPV6_PREFIXES has to be a comma separated list of at most %d IPv6 prefixes\n", IPv6_PREFIXES);
+		return 1;
+	}
+
+	// ... and the same address dictionary
+	const char* dictionary = getenv("DTOKEN_ADDRESS_DICTIONARY");
+	if (dictionary && set_address_dictionary(dictionary, strlen(dictionary)) != 0)
+	{
+		fprintf(stderr, "DTOKEN_ADDRESS_DICTIONARY has to be a list of at most %d distinct addresses without ports\n", DICTIONARY_ADDRESSES);
+		return 1;
+	}
+
+	if (argc > 1)
+	{
+		return print_token(argv[1]);
+	}
+
 	// Request timestamp
 	_Bool time_type = 0; // 0 = s, 1 = µs
 	struct timeval tv;
@@ -355,21 +2612,18 @@ int main()
 
 	// Information about the client connection
 	_Bool client_enabled = 0;
-	int client_protocol = AF_INET;
+	struct token_address client;
 	char client_address[INET6_ADDRSTRLEN] = "";
-	int client_port = 0;
 
 	// Information about load balancer connection
 	_Bool lb_enabled = 0;
-	short int lb_protocol = AF_INET;
+	struct token_address lb;
 	char lb_address[INET6_ADDRSTRLEN] = "";
-	short int lb_port = 0;
 
 	// Information about web server connection
 	_Bool server_enabled = 0;
-	short int server_protocol = AF_INET;
+	struct token_address server;
 	char server_address[INET6_ADDRSTRLEN] = "";
-	short int server_port = 0;
 
 	// Generic id 1
 	int id1 = 0;
@@ -377,7 +2631,7 @@ int main()
 	// Generic id 2
 	int id2 = 0;
 
-	char input[45];
+	char input[64];
 	char* message;
 
 	// Set time precision
@@ -430,7 +2684,7 @@ int main()
 	}
 
 	// Add client data
-	message = "Enter client IP address (leave empty for none)";
+	message = "Enter client IP address, optionally with a port (leave empty for none)";
 	printf("%s: ", message);
 	while (fgets(input, sizeof(input), stdin))
 	{
@@ -441,38 +2695,18 @@ int main()
 			break;
 		}
 
-		struct sockaddr_in sa;
-
-		// For IP validation
-		int result;
-
-		result = inet_pton(AF_INET, input, &(sa.sin_addr));
-
-		// Valid IPv4
-		if (result == 1)
-		{
-			client_enabled = 1;
-			client_protocol = AF_INET;
-			strcpy(client_address, input);
-			break;
-		}
-
-		struct sockaddr_in6 sa6;
-		result = inet_pton(AF_INET6, input, &(((struct sockaddr_in6 *)&sa6)->sin6_addr));
-
-		// Valid IPv6
-		if (result == 1)
+		if (parse_address(&client, input, strlen(input)) == 0)
 		{
 			client_enabled = 1;
-			client_protocol = AF_INET6;
-			strcpy(client_address, input);
+			inet_ntop(client.protocol, &client.ip, client_address, sizeof(client_address));
 			break;
 		}
 
 		printf("Invalid address.\n%s: ", message);
 	}
 
-	if (client_enabled)
+	// Ask for a port unless one was given with the address
+	if (client_enabled && client.port == 0)
 	{
 		message = "Enter client port (leave empty for none)";
 		printf("%s: ", message);
@@ -489,7 +2723,7 @@ int main()
 			int entered_port = atoi(input);
 			if (entered_port > 0 && entered_port <= 65535)
 			{
-				client_port = entered_port;
+				client.port = entered_port;
 				break;
 			}
 
@@ -498,7 +2732,7 @@ int main()
 	}
 
 	// Add load balancer data
-	message = "Enter load balancer IP address (leave empty for none)";
+	message = "Enter load balancer IP address, optionally with a port (leave empty for none)";
 	printf("%s: ", message);
 	while (fgets(input, sizeof(input), stdin))
 	{
@@ -509,38 +2743,18 @@ int main()
 			break;
 		}
 
-		struct sockaddr_in sa;
-
-		// For IP validation
-		int result;
-
-		result = inet_pton(AF_INET, input, &(sa.sin_addr));
-
-		// Valid IPv4
-		if (result == 1)
-		{
-			lb_enabled = 1;
-			lb_protocol = AF_INET;
-			strcpy(lb_address, input);
-			break;
-		}
-
-		struct sockaddr_in6 sa6;
-		result = inet_pton(AF_INET6, input, &(((struct sockaddr_in6 *)&sa6)->sin6_addr));
-
-		// Valid IPv6
-		if (result == 1)
+		if (parse_address(&lb, input, strlen(input)) == 0)
 		{
 			lb_enabled = 1;
-			lb_protocol = AF_INET6;
-			strcpy(lb_address, input);
+			inet_ntop(lb.protocol, &lb.ip, lb_address, sizeof(lb_address));
 			break;
 		}
 
 		printf("Invalid address.\n%s: ", message);
 	}
 
-	if (lb_enabled)
+	// Ask for a port unless one was given with the address
+	if (lb_enabled && lb.port == 0)
 	{
 		message = "Enter load balancer port (leave empty for none)";
 		printf("%s: ", message);
@@ -557,7 +2771,7 @@ int main()
 			int entered_port = atoi(input);
 			if (entered_port > 0 && entered_port <= 65535)
 			{
-				lb_port = entered_port;
+				lb.port = entered_port;
 				break;
 			}
 
@@ -566,7 +2780,7 @@ int main()
 	}
 
 	// Add server data
-	message = "Enter server IP address (leave empty for none)";
+	message = "Enter server IP address, optionally with a port (leave empty for none)";
 	printf("%s: ", message);
 	while (fgets(input, sizeof(input), stdin))
 	{
@@ -577,38 +2791,18 @@ int main()
 			break;
 		}
 
-		struct sockaddr_in sa;
-
-		// For IP validation
-		int result;
-
-		result = inet_pton(AF_INET, input, &(sa.sin_addr));
-
-		// Valid IPv4
-		if (result == 1)
-		{
-			server_enabled = 1;
-			server_protocol = AF_INET;
-			strcpy(server_address, input);
-			break;
-		}
-
-		struct sockaddr_in6 sa6;
-		result = inet_pton(AF_INET6, input, &(((struct sockaddr_in6 *)&sa6)->sin6_addr));
-
-		// Valid IPv6
-		if (result == 1)
+		if (parse_address(&server, input, strlen(input)) == 0)
 		{
 			server_enabled = 1;
-			server_protocol = AF_INET6;
-			strcpy(server_address, input);
+			inet_ntop(server.protocol, &server.ip, server_address, sizeof(server_address));
 			break;
 		}
 
 		printf("Invalid address.\n%s: ", message);
 	}
 
-	if (server_enabled)
+	// Ask for a port unless one was given with the address
+	if (server_enabled && server.port == 0)
 	{
 		message = "Enter server port (leave empty for none)";
 		printf("%s: ", message);
@@ -625,7 +2819,7 @@ int main()
 			int entered_port = atoi(input);
 			if (entered_port > 0 && entered_port <= 65535)
 			{
-				server_port = entered_port;
+				server.port = entered_port;
 				break;
 			}
 
@@ -697,15 +2891,15 @@ int main()
 
 	// Output client information
 	//-----------------------------------------------------
-	PRINT_ADDRESS(client_enabled, "\033[1mClient\033[0m", client_address, client_port);
+	PRINT_ADDRESS(client_enabled, "\033[1mClient\033[0m", client_address, client.port);
 
 	// Output load balancer information
 	//-----------------------------------------------------
-	PRINT_ADDRESS(lb_enabled, "\033[1mLoad balancer\033[0m", lb_address, lb_port);
+	PRINT_ADDRESS(lb_enabled, "\033[1mLoad balancer\033[0m", lb_address, lb.port);
 
 	// Output server information
 	//-----------------------------------------------------
-	PRINT_ADDRESS(server_enabled, "\033[1mServer\033[0m", server_address, server_port);
+	PRINT_ADDRESS(server_enabled, "\033[1mServer\033[0m", server_address, server.port);
 
 	if (id1)
 	{
@@ -724,41 +2918,21 @@ int main()
 	// Build and output token
 	//-----------------------------------------------------
 
-	int buffer_size =
-		VERSION_PATCH_SIZE +
-		VERSION_MINOR_SIZE +
-		VERSION_MAJOR_SIZE +
-		TIME_TYPE_SIZE +
-		TIME_US_SIZE +
-		METHOD_SIZE +
-		ID1_SIZE +
-		ID2_SIZE +
-		((2 + PORT_SIZE) * 3) + // x number of addresses + extra bits for meta
-		((2 + IPv6_SIZE) * 3) + // x number of addresses + extra bits for meta
-		100; // Adding some extra bits for good measure
-
-	char token_buffer[(int)ceil(buffer_size / 8)];
-
-	char* token = build(
+	char token_buffer[TOKEN_MAX_LENGTH + 1];
+
+	build(
 		token_buffer,
 		method,
 		time_type,
 		timestamp,
-		client_enabled,
-		client_protocol,
-		client_address,
-		client_port,
-		lb_enabled,
-		lb_protocol,
-		lb_address,
-		lb_port,
-		server_enabled,
-		server_protocol,
-		server_address,
-		server_port,
+		client_enabled ? &client : NULL,
+		lb_enabled ? &lb : NULL,
+		server_enabled ? &server : NULL,
 		id1,
-		id2
+		id2,
+		0,
+		ENCODING_BASE36
 	);
 
-	printf("\nToken: %s\n", token);
+	printf("\nToken: %s\n", token_buffer);
 }
@@ -34,14 +34,14 @@
 #include <sys/time.h>
 #include <arpa/inet.h>
 #include <math.h>
-#include <gmp.h>
+#include <stdint.h>
 
 #define STR(x) #x
 #define CONCAT(a, b, c) STR(a) "." STR(b) "." STR(c)
 
 /* Version info for this application */
 #define VERSION_MAJOR 0
-#define VERSION_MINOR 1
+#define VERSION_MINOR 2
 #define VERSION_PATCH 0
 #define VERSION CONCAT(VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH)
 
@@ -73,16 +73,131 @@
 #define PORT_SIZE 16
 #define IPv4_SIZE 32
 #define IPv6_SIZE 128
+#define COMPACT_KIND_SIZE 2
+#define PREFIX_INDEX_SIZE 4
+#define DICTIONARY_INDEX_SIZE 10
+
+#define VERSION_SIZE (VERSION_PATCH_SIZE + VERSION_MINOR_SIZE + VERSION_MAJOR_SIZE)
+
+/* Token layouts */
+#define LAYOUT_STANDARD 0 /* version and time in the least significant bits */
+#define LAYOUT_SORTABLE 1 /* version and time in the most significant bits */
+
+/* Largest address segment: enabled, protocol, compact and port bits, address and port */
+#define ADDRESS_MAX_SIZE (4 + IPv6_SIZE + PORT_SIZE)
+#define SEGMENT_WORDS ((ADDRESS_MAX_SIZE + 63) / 64)
+
+/* Largest possible token in the standard layout, in bits */
+#define STANDARD_MAX_SIZE ( \
+	VERSION_SIZE + \
+	TIME_TYPE_SIZE + \
+	TIME_US_SIZE + \
+	METHOD_SIZE + \
+	(ADDRESS_MAX_SIZE * 3) + \
+	(1 + ID1_SIZE) + \
+	(1 + ID2_SIZE))
+
+/*
+ * The sortable layout is always SORTABLE_SIZE bits, with a marker bit just
+ * above the largest standard token. Below the marker come the version, time
+ * type and timestamp (always 52 bits wide), so that tokens of equal length
+ * sort by time. The rest of the token sits in the least significant bits.
+ */
+#define SORTABLE_SIZE (STANDARD_MAX_SIZE + 1)
+#define SORTABLE_HEAD_SIZE (1 + VERSION_SIZE + TIME_TYPE_SIZE + TIME_US_SIZE)
+#define SORTABLE_HEAD_OFFSET (SORTABLE_SIZE - SORTABLE_HEAD_SIZE)
+
+/* Largest possible token in bits, and the 64-bit words needed to hold it */
+#define TOKEN_MAX_SIZE SORTABLE_SIZE
+#define TOKEN_WORDS ((TOKEN_MAX_SIZE + 63) / 64)
+
+/* Token encodings */
+#define ENCODING_BASE36 0
+#define ENCODING_BASE32 1 /* Crockford's base 32 */
+#define ENCODING_BASE64URL 2 /* base 64 with the URL and filename safe alphabet */
+#define ENCODING_RAW 3 /* big-endian bytes */
+
+/* Characters needed for a TOKEN_MAX_SIZE bit token in each encoding (excluding the NUL) */
+#define BASE36_MAX_LENGTH 108
+#define BASE32_MAX_LENGTH ((TOKEN_MAX_SIZE + 4) / 5)
+#define BASE64URL_MAX_LENGTH ((TOKEN_MAX_SIZE + 5) / 6)
+#define RAW_MAX_LENGTH ((TOKEN_MAX_SIZE + 7) / 8)
+
+/* The longest of the above */
+#define TOKEN_MAX_LENGTH BASE32_MAX_LENGTH
+
+/*
+ * Base 36 conversion works in chunks of 36^12, the largest power of 36 that
+ * fits in 64 bits. The divisor is normalised (shifted until its top bit is
+ * set) and divided by through its precomputed reciprocal,
+ * floor((2^128 - 1) / BASE36_CHUNK_NORM) - 2^64.
+ */
+#define BASE36_CHUNK 4738381338321616896ULL
+#define BASE36_CHUNK_DIGITS 12
+#define BASE36_CHUNK_SHIFT 1
+#define BASE36_CHUNK_NORM 0x83843971c2000000ULL
+#define BASE36_CHUNK_INV 0xf24f62335024a295ULL
+#define BASE36_CHUNKS ((BASE36_MAX_LENGTH + BASE36_CHUNK_DIGITS - 1) / BASE36_CHUNK_DIGITS)
+
+/* Decoding pads strings to whole chunks, in a buffer rounded up for SIMD */
+#define BASE36_DECODE_SIZE (BASE36_CHUNKS * BASE36_CHUNK_DIGITS)
+#define BASE36_DECODE_BUFFER ((BASE36_DECODE_SIZE + 31) & ~31)
+
+/* Output options for build() */
+#define TOKEN_FIXED_LENGTH 1 /* left pad with zero digits to the longest length of the encoding */
+#define TOKEN_SORTABLE 2 /* use the sortable layout (always the longest length of the encoding) */
 
 #define INET4 0 /* bit to store for AF_INET  */
 #define INET6 1 /* bit to store for AF_INET6 */
 
+/* Shorter forms of addresses, stored after the IPv6 protocol bit and a set compact bit */
+#define COMPACT_MAPPED 0 /* IPv4-mapped address (::ffff:a.b.c.d), stored as the IPv4 address */
+#define COMPACT_PREFIX 1 /* index of a configured prefix, followed by the rest of the address */
+#define COMPACT_KNOWN 2 /* index of an IPv4 or IPv6 address in the address dictionary */
+
+/* Number of IPv6 prefixes that can be configured, see set_ipv6_prefixes() */
+#define IPv6_PREFIXES (1 << PREFIX_INDEX_SIZE)
+
+/* Shortest prefix that can be configured, so that a compact address is never longer than a full one */
+#define IPv6_PREFIX_MIN_LENGTH 16
+
+/* Number of addresses the address dictionary can hold, see set_address_dictionary() */
+#define DICTIONARY_ADDRESSES (1 << DICTIONARY_INDEX_SIZE)
+
+/* The version segment, as stored in the low 16 bits of every token */
+#define VERSION_BITS ( \
+	VERSION_PATCH | \
+	(VERSION_MINOR << VERSION_PATCH_SIZE) | \
+	(VERSION_MAJOR << (VERSION_PATCH_SIZE + VERSION_MINOR_SIZE)))
+
+/*
+ * The version segment of tokens written by Dtoken 0.1.0, which are still
+ * read. They only have the standard layout, and their IPv6 addresses are
+ * stored in full, without the compact bit.
+ */
+#define VERSION_0_1_0_BITS (1 << VERSION_PATCH_SIZE)
+
+/* Address segment kinds, each with its own specialised encoder */
+#define ADDRESS_NONE 0
+#define ADDRESS_IPv4 1
+#define ADDRESS_IPv4_PORT 2
+#define ADDRESS_IPv6 3
+#define ADDRESS_IPv6_PORT 4
+#define ADDRESS_KINDS 5
+
+/* Selects the address segment kind without branching on the inputs */
+#define ADDRESS_KIND(enabled, protocol, port) \
+	((enabled) ? 1 + ((protocol) != AF_INET) * 2 + ((port) != 0) : ADDRESS_NONE)
+
 #define PRINT_ADDRESS(enabled, prefix, address, port) \
 	do { \
 		if (enabled) { \
-			printf("%s: %s", prefix, address); \
-			if (port) { \
-				printf(":%d", port); \
+			if (port && strchr(address, ':')) { \
+				printf("%s: [%s]:%d", prefix, address, port); \
+			} else if (port) { \
+				printf("%s: %s:%d", prefix, address, port); \
+			} else { \
+				printf("%s: %s", prefix, address); \
 			} \
 			printf("\n"); \
 		} \
@@ -93,6 +208,7 @@
  *
  * @struct token_data
  *
+ * @param short int layout The layout of the token (LAYOUT_STANDARD or LAYOUT_SORTABLE)
  * @param short int time_type The format used for the timestamp: 0 = seconds, 1 = microseconds
  * @param long int timestamp The timestamp of the request, in either seconds or microseconds
  * @param int method The HTTP method used for the request
@@ -110,9 +226,12 @@
  * @param short int server_port The port connected to on the web server
  * @param int id1 Generic id (e.g. user id)
  * @param int id2 Generic id (e.g. page id)
+ * @param struct token_segment* lb_segment Pre-encoded load balancer segment, used instead of the lb_* fields if set
+ * @param struct token_segment* server_segment Pre-encoded web server segment, used instead of the server_* fields if set
  */
 struct token_data
 {
+	short int layout;
 	short int time_type;
 	long int timestamp;
 	int method;
@@ -130,81 +249,404 @@ struct token_data
 	short int server_port;
 	int id1;
 	int id2;
+	const struct token_segment* lb_segment;
+	const struct token_segment* server_segment;
 };
 
 /**
- * Adds a port number to the given token
+ * Fixed-width integer the token is packed into
+ *
+ * Fields are appended from the least significant bit upwards, so the value is
+ * the same as shifting each field in from the right, last field first. One
+ * spare word is kept so fields can be written without checking whether they
+ * straddle the end of the token.
  *
- * @param mpz_ptr token The token to add the port number to
- * @param short int port The port number to add
+ * @struct token_bits
+ *
+ * @param uint64_t word The token value, least significant word first
+ * @param unsigned int size The number of bits written so far
  */
-void add_port(mpz_ptr token, short int port);
+struct token_bits
+{
+	uint64_t word[TOKEN_WORDS + 1];
+	unsigned int size;
+};
 
 /**
- * Adds an address to the given token
+ * A pre-encoded address segment, ready to be spliced into a token
+ *
+ * Addresses that are the same for every request (such as the web server's)
+ * can be encoded once and reused.
+ *
+ * @struct token_segment
  *
- * @param mpz_ptr token The token to add the address to
+ * @param uint64_t word The segment bits, least significant word first
+ * @param unsigned int size The number of bits in the segment
+ */
+struct token_segment
+{
+	uint64_t word[SEGMENT_WORDS];
+	unsigned int size;
+};
+
+/**
+ * An IP address and port, as read by parse_address()
+ *
+ * @struct token_address
+ *
+ * @param short int protocol The protocol of the address (AF_INET or AF_INET6)
+ * @param union { struct in_addr v4; struct in6_addr v6; } ip The IP address
+ * @param unsigned short int port The port, or 0 for none
+ */
+struct token_address
+{
+	short int protocol;
+	union { struct in_addr v4; struct in6_addr v6; } ip;
+	unsigned short int port;
+};
+
+/**
+ * Bit offsets of the fields of a token, so single fields can be read
+ *
+ * @struct token_index
+ *
+ * @param short int layout The layout of the token (LAYOUT_STANDARD or LAYOUT_SORTABLE)
+ * @param short int time_type The format used for the timestamp: 0 = seconds, 1 = microseconds
+ * @param short int compact Whether IPv6 addresses start with the compact bit (0 for Dtoken 0.1.0 tokens)
+ * @param unsigned int timestamp Offset of the timestamp
+ * @param unsigned int method Offset of the HTTP method
+ * @param unsigned int client Offset of the client address segment
+ * @param unsigned int lb Offset of the load balancer address segment
+ * @param unsigned int server Offset of the web server address segment
+ * @param unsigned int id1 Offset of the first generic id, starting with its flag
+ * @param unsigned int id2 Offset of the second generic id, starting with its flag
+ */
+struct token_index
+{
+	short int layout;
+	short int time_type;
+	short int compact;
+	unsigned int timestamp;
+	unsigned int method;
+	unsigned int client;
+	unsigned int lb;
+	unsigned int server;
+	unsigned int id1;
+	unsigned int id2;
+};
+
+/**
+ * Adds an address segment, including its port, to the given token
+ *
+ * @param struct token_bits* token The token to add the address to
  * @param short int enabled Whether the address is enabled or not
  * @param short int protocol The protocol used by the address (IPv4 or IPv6)
  * @param void* ip The IP address to add
+ * @param short int port The port number to add, or 0 for none
  */
 void add_address(
-	mpz_ptr token,
+	struct token_bits *token,
 	short int enabled,
 	short int protocol,
-	void* ip
+	void* ip,
+	short int port
+);
+
+/**
+ * Sets the IPv6 prefixes that are stored as an index instead of in full
+ *
+ * Addresses in one of the prefixes are stored as the index of the prefix
+ * and the bits after it. Tokens are read with the same table, so the list
+ * has to be the same, in the same order, wherever tokens are built or read.
+ * Prefixes are at least IPv6_PREFIX_MIN_LENGTH bits long.
+ *
+ * @param char* list Comma separated prefixes (e.g. "2001:db8:1::/48, 2001:db8:2:3::/64")
+ * @param size_t length The length of the list
+ *
+ * @return int 0 on success, or -1 if the list is not valid (the prefixes are then left as they were)
+ */
+int set_ipv6_prefixes(const char* list, size_t length);
+
+/**
+ * Sets the addresses that are stored as an index instead of in full
+ *
+ * Meant for the few load balancers and web servers of a site, which then
+ * take 15 bits instead of up to 131. Only load balancer and web server
+ * addresses are looked up; client addresses are always stored as they are.
+ * Tokens are read with the same dictionary; addresses can be added to the
+ * end without changing how earlier tokens are read.
+ *
+ * @param char* list IPv4 or IPv6 addresses, separated by commas or white space, "#" starting a comment up to the end of the line
+ * @param size_t length The length of the list
+ *
+ * @return int 0 on success, or -1 if the list is not valid or holds an address twice (the dictionary is then left as it was)
+ */
+int set_address_dictionary(const char* list, size_t length);
+
+/**
+ * Encodes a load balancer or web server address segment, including its port, for later use
+ *
+ * @param struct token_segment* segment Where to store the segment
+ * @param short int enabled Whether the address is enabled or not
+ * @param short int protocol The protocol used by the address (IPv4 or IPv6)
+ * @param void* ip The IP address to add
+ * @param short int port The port number to add, or 0 for none
+ */
+void encode_segment(
+	struct token_segment *segment,
+	short int enabled,
+	short int protocol,
+	void* ip,
+	short int port
 );
 
 /**
  * Adds token data to the given token
  *
- * @param mpz_ptr token The token to add the data to
+ * @param struct token_bits* token The token to add the data to
  * @param struct token_data data The data to add
  */
-void add_token_data(mpz_ptr token, struct token_data *data);
+void add_token_data(struct token_bits *token, struct token_data *data);
+
+/**
+ * Writes the given token to a buffer as a base 36 string
+ *
+ * @param char* buffer The buffer to write to, at least BASE36_MAX_LENGTH + 1 bytes
+ * @param struct token_bits* token The token to encode
+ * @param size_t width The minimum length of the string, left padded with '0' (0 for none)
+ *
+ * @return size_t The length of the string written, excluding the NUL
+ */
+size_t encode_base36(char* buffer, const struct token_bits *token, size_t width);
+
+/**
+ * Writes a token to a buffer in one encoding and padding, see get_token_encoder()
+ *
+ * @param char* buffer The buffer to write to, at least TOKEN_MAX_LENGTH + 1 bytes
+ * @param struct token_bits* token The token to encode
+ *
+ * @return size_t The length of the token written, excluding the NUL
+ */
+typedef size_t (*token_encoder)(char* buffer, const struct token_bits *token);
+
+/**
+ * Gets the function writing tokens in the given encoding
+ *
+ * Callers encoding many tokens the same way can look the encoder up once.
+ *
+ * @param int encoding The encoding to use (see ENCODING_* macros)
+ * @param int flags Output options (TOKEN_FIXED_LENGTH to pad to a fixed length)
+ *
+ * @return token_encoder The encoder, base 36 if the encoding is unknown
+ */
+token_encoder get_token_encoder(int encoding, int flags);
+
+/**
+ * Gets the length of the string encode_token() writes for the given token
+ *
+ * Exact for base 32, base 64 and raw, and at most one character over for base 36.
+ *
+ * @param struct token_bits* token The token to encode
+ * @param int encoding The encoding to use (see ENCODING_* macros)
+ * @param int flags Output options (TOKEN_FIXED_LENGTH to pad to a fixed length)
+ *
+ * @return size_t The length of the string, excluding the NUL
+ */
+size_t encoded_length(const struct token_bits *token, int encoding, int flags);
+
+/**
+ * Writes the given token to a buffer in the given encoding
+ *
+ * @param char* buffer The buffer to write to, at least TOKEN_MAX_LENGTH + 1 bytes
+ * @param struct token_bits* token The token to encode
+ * @param int encoding The encoding to use (see ENCODING_* macros)
+ * @param int flags Output options (TOKEN_FIXED_LENGTH to pad to a fixed length)
+ *
+ * @return size_t The length of the token written, excluding the NUL
+ */
+size_t encode_token(char* buffer, const struct token_bits *token, int encoding, int flags);
+
+/**
+ * Reads a token in the given encoding
+ *
+ * @param struct token_bits* token The token to store the value in
+ * @param char* str The encoded token
+ * @param size_t length The length of the encoded token
+ * @param int encoding The encoding of the token (see ENCODING_* macros)
+ *
+ * @return int 0 on success, or -1 if the string is not a valid token value
+ */
+int decode_token(struct token_bits *token, const char* str, size_t length, int encoding);
 
- /**
+/**
+ * Finds the fields of the given token, without reading them
+ *
+ * @param struct token_index* index Where to store the offsets of the fields
+ * @param struct token_bits* token The token to index
+ *
+ * @return int 0 on success, or -1 if the token is not valid
+ */
+int index_token(struct token_index *index, const struct token_bits *token);
+
+/**
+ * Reads the timestamp of an indexed token
+ *
+ * @param struct token_bits* token The token to read from
+ * @param struct token_index* index The offsets of its fields
+ *
+ * @return long int The timestamp, in seconds or microseconds depending on the time type
+ */
+long int read_token_timestamp(const struct token_bits *token, const struct token_index *index);
+
+/**
+ * Reads the HTTP method of an indexed token
+ *
+ * @param struct token_bits* token The token to read from
+ * @param struct token_index* index The offsets of its fields
+ *
+ * @return int The HTTP method, 0 if unknown
+ */
+int read_token_method(const struct token_bits *token, const struct token_index *index);
+
+/**
+ * Reads an address segment of an indexed token
+ *
+ * @param struct token_bits* token The token to read from
+ * @param struct token_index* index The offsets of its fields
+ * @param unsigned int offset The offset of the segment (client, lb or server of the index)
+ * @param short int* enabled Where to store whether the address is included
+ * @param short int* protocol Where to store the protocol (AF_INET or AF_INET6)
+ * @param void* ip Where to store the address, as a struct in_addr or struct in6_addr
+ * @param short int* port Where to store the port, 0 if none
+ */
+void read_token_address(
+	const struct token_bits *token,
+	const struct token_index *index,
+	unsigned int offset,
+	short int* enabled,
+	short int* protocol,
+	void* ip,
+	short int* port
+);
+
+/**
+ * Reads a generic id of an indexed token
+ *
+ * @param struct token_bits* token The token to read from
+ * @param unsigned int offset The offset of the id (id1 or id2 of the index)
+ * @param unsigned int size The width of the id (ID1_SIZE or ID2_SIZE)
+ *
+ * @return int The id, 0 if not included
+ */
+int read_token_id(const struct token_bits *token, unsigned int offset, unsigned int size);
+
+/**
+ * Reads token data from the given token
+ *
+ * @param struct token_data* data Where to store the token data
+ * @param struct token_bits* token The token to read
+ *
+ * @return int 0 on success, or -1 if the token is not valid
+ */
+int read_token_data(struct token_data *data, const struct token_bits *token);
+
+/**
+ * Reads a base 36 string into the given token
+ *
+ * @param struct token_bits* token The token to store the value in
+ * @param char* str The base 36 string
+ * @param size_t length The length of the string
+ *
+ * @return int 0 on success, or -1 if the string is not a valid token value
+ */
+int decode_base36(struct token_bits *token, const char* str, size_t length);
+
+/**
+ * Reads an IP address, optionally with a port, in a single scan
+ *
+ * Accepts IPv4 (`192.0.2.1`), IPv4 with a port (`192.0.2.1:8080`), IPv6
+ * (`2001:db8::1`) and bracketed IPv6 with or without a port
+ * (`[2001:db8::1]:8080`).
+ *
+ * @param struct token_address* address Where to store the address
+ * @param char* str The address string, not necessarily NUL terminated
+ * @param size_t length The length of the string
+ *
+ * @return int 0 on success, or -1 if the string is not a valid address
+ */
+int parse_address(struct token_address *address, const char* str, size_t length);
+
+/**
+ * Builds a request token from data that is already in binary form
+ *
+ * Callers holding binary addresses fill the token data directly, instead of
+ * formatting them as text for build(). The layout is data->layout, and
+ * data->lb_segment and data->server_segment have to be set, to NULL when the
+ * lb_* and server_* fields are used.
+ *
+ * @param char* buffer The buffer to store the token in, at least TOKEN_MAX_LENGTH + 1 bytes
+ * @param struct token_data* data The data to store in the token
+ * @param int flags Output options (TOKEN_FIXED_LENGTH to pad to a fixed length)
+ * @param int encoding The encoding of the token (see ENCODING_* macros)
+ *
+ * @return size_t The length of the generated request token
+ */
+size_t build_from_data(char* buffer, struct token_data *data, int flags, int encoding);
+
+/**
  * Builds a request token using the given parameters
  *
  * @param char* buffer The buffer to store the token in
  * @param int method The HTTP method used for the request (see macros for mapping)
  * @param _Bool time_type The type of timestamp used (second (0) or microsecond (1) precision)
  * @param long int timestamp The timestamp of the request
- * @param _Bool client_enabled Whether the client address is enabled or not
- * @param short int client_protocol The protocol used by the client address (IPv4 or IPv6)
- * @param char* client_address The IP address of the client
- * @param short int client_port The port number used by the client
- * @param _Bool lb_enabled Whether the load balancer address is enabled or not
- * @param short int lb_protocol The protocol used by the load balancer address (IPv4 or IPv6)
- * @param char* lb_address The IP address of the load balancer
- * @param short int lb_port The port number used by the load balancer
- * @param _Bool server_enabled Whether the server address is enabled or not
- * @param short int server_protocol The protocol used by the server address (IPv4 or IPv6)
- * @param char* server_address The IP address of the server
- * @param short int server_port The port number used by the server
+ * @param struct token_address* client The address of the client, or NULL for none
+ * @param struct token_address* lb The address of the load balancer, or NULL for none
+ * @param struct token_address* server The address of the server, or NULL for none
  * @param int id1 The first generic id value to include in the token
  * @param int id2 The second generic id value to include in the token
+ * @param int flags Output options (TOKEN_FIXED_LENGTH to pad to a fixed length, TOKEN_SORTABLE for the sortable layout)
+ * @param int encoding The encoding of the token (see ENCODING_* macros)
  *
- * @return char* The generated request token as base 36
+ * @return size_t The length of the generated request token
  */
-char* build(
+size_t build(
 	char* buffer,
 	int method,
 	_Bool time_type,
 	long int timestamp,
-	_Bool client_enabled,
-	short int client_protocol,
-	char* client_address,
-	short int client_port,
-	_Bool lb_enabled,
-	short int lb_protocol,
-	char* lb_address,
-	short int lb_port,
-	_Bool server_enabled,
-	short int server_protocol,
-	char* server_address,
-	short int server_port,
+	const struct token_address *client,
+	const struct token_address *lb,
+	const struct token_address *server,
 	int id1,
-	int id2);
+	int id2,
+	int flags,
+	int encoding);
+
+/**
+ * Parses a request token back into its data
+ *
+ * @param struct token_data* data Where to store the token data
+ * @param char* token The token to parse
+ * @param size_t length The length of the token
+ * @param int encoding The encoding of the token (see ENCODING_* macros)
+ *
+ * @return int 0 on success, or -1 if the token is not valid
+ */
+int parse(struct token_data *data, const char* token, size_t length, int encoding);
+
+/**
+ * Converts a request token from one encoding to another
+ *
+ * @param char* buffer The buffer to store the converted token in, at least TOKEN_MAX_LENGTH + 1 bytes
+ * @param char* token The token to convert
+ * @param size_t length The length of the token
+ * @param int from The encoding of the token (see ENCODING_* macros)
+ * @param int to The encoding to convert to (see ENCODING_* macros)
+ * @param int flags Output options (TOKEN_FIXED_LENGTH to pad to a fixed length)
+ *
+ * @return size_t The length of the converted token, or 0 if the token is not valid
+ */
+size_t convert_token(char* buffer, const char* token, size_t length, int from, int to, int flags);
 
 #endif /* DTOKEN_H */
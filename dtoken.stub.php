@@ -0,0 +1,78 @@
+<?php
+
+/** @generate-class-entries */
+
+namespace {
+	/**
+	 * @frameless-function {"arity": 0}
+	 * @frameless-function {"arity": 1}
+	 */
+	function dtoken_build(
+		?int $method = null,
+		?int $precision = null,
+		?int $timestamp = null,
+		?string $address = null,
+		?string $balancer = null,
+		?string $server = null,
+		?int $id1 = null,
+		?int $id2 = null,
+		?int $flags = null,
+		?int $encoding = null
+	): string {}
+
+	function dtoken_build_binary(
+		?int $method = null,
+		?int $precision = null,
+		?int $timestamp = null,
+		?string $address = null,
+		?string $balancer = null,
+		?string $server = null,
+		?int $id1 = null,
+		?int $id2 = null,
+		?int $flags = null
+	): string {}
+
+	function dtoken_build_many(array $records, ?int $flags = null, ?int $encoding = null): array {}
+
+	function dtoken_convert(string $token, int $from, int $to, int $flags = 0): string|false {}
+
+	function dtoken_current(): string {}
+
+	function dtoken_parse(string $token, int $encoding = DTOKEN_BASE36): array|false {}
+
+	function dtoken_parse_many(array $tokens, int $encoding = DTOKEN_BASE36): array {}
+}
+
+namespace Dtoken {
+	/**
+	 * @strict-properties
+	 * @not-serializable
+	 */
+	final class Token
+	{
+		public function __construct(string $token, int $encoding = DTOKEN_BASE36) {}
+	}
+
+	/**
+	 * @strict-properties
+	 * @not-serializable
+	 */
+	final class Builder
+	{
+		public function __construct(
+			?int $precision = null,
+			?string $balancer = null,
+			?string $server = null,
+			?int $flags = null,
+			?int $encoding = null
+		) {}
+
+		public function build(
+			?int $method = null,
+			?int $timestamp = null,
+			?string $address = null,
+			?int $id1 = null,
+			?int $id2 = null
+		): string {}
+	}
+}
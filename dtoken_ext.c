@@ -1,336 +1,2129 @@
 #include <arpa/inet.h>
 #include <php.h>
 #include "main/SAPI.h"
+#include "main/php_variables.h"
 #include "ext/standard/info.h"
 #include "dtoken.h"
+#include "dtoken_arginfo.h"
 
-PHP_FUNCTION(dtoken_build);
+/*
+ * A pre-encoded address segment and the address it was encoded from. Kept
+ * per worker for addresses that rarely change between requests.
+ */
+struct segment_cache
+{
+	short int enabled;
+	struct token_address address;
+	struct token_segment segment;
+};
+
+/*
+ * An address segment set in php.ini, encoded when the setting changes
+ */
+struct configured_segment
+{
+	short int enabled; /* 0 when the address is detected for each request */
+	struct token_segment segment;
+};
+
+/*
+ * How tokens are built when the caller leaves the options out, compiled from
+ * the INI settings whenever one of them changes
+ */
+struct encoding_plan
+{
+	_Bool time_type; /* dtoken.precision */
+	int flags; /* dtoken.layout */
+	int encoding; /* dtoken.encoding */
+	token_encoder encoder; /* writes tokens in the encoding and layout above */
+	struct configured_segment lb; /* dtoken.balancer_address */
+	struct configured_segment server; /* dtoken.server_address */
+};
+
+ZEND_BEGIN_MODULE_GLOBALS(dtoken)
+	zend_string* current; /* token of the current request, built on first use */
+	struct segment_cache lb; /* load balancer segment of the last token */
+	struct segment_cache server; /* web server segment of the last token */
+	struct encoding_plan plan;
+	zend_bool auto_token; /* dtoken.auto */
+ZEND_END_MODULE_GLOBALS(dtoken)
+
+ZEND_DECLARE_MODULE_GLOBALS(dtoken)
+
+#define DTOKEN_G(v) ZEND_MODULE_GLOBALS_ACCESSOR(dtoken, v)
+
+/*
+ * A Dtoken\Token object. Only the packed token and the offsets of its fields
+ * are kept, each field is read when it is accessed.
+ */
+struct token_object
+{
+	struct token_bits bits;
+	struct token_index index;
+	_Bool parsed; /* whether the constructor succeeded */
+	zend_object std;
+};
+
+#define TOKEN_OBJECT(object) ((struct token_object *)((char *)(object) - XtOffsetOf(struct token_object, std)))
+
+zend_class_entry* token_ce;
+zend_object_handlers token_handlers;
 
-zend_function_entry dtoken_functions[] =
+/*
+ * A Dtoken\Builder object. Everything that stays the same between requests
+ * is checked and encoded once, by the constructor.
+ */
+struct builder_object
 {
-	PHP_FE(dtoken_build, NULL)
-	{NULL, NULL, NULL}
+	_Bool time_type;
+	int flags;
+	int encoding;
+	token_encoder encoder;
+	struct token_segment lb;
+	struct token_segment server;
+	zend_object std;
 };
 
+#define BUILDER_OBJECT(object) ((struct builder_object *)((char *)(object) - XtOffsetOf(struct builder_object, std)))
+
+zend_class_entry* builder_ce;
+zend_object_handlers builder_handlers;
+
+void register_token_class();
+void register_builder_class();
+zend_string* get_default_token(zend_long method);
+int set_trusted_proxies(const char* list, size_t length);
+void free_trusted_proxies();
+
+/* The SAPI's own server variables, called before adding $_SERVER['DTOKEN'] */
+void (*original_register_server_variables)(zval* track_vars_array);
+
+PHP_MINIT_FUNCTION(dtoken);
+PHP_MSHUTDOWN_FUNCTION(dtoken);
+PHP_RINIT_FUNCTION(dtoken);
+PHP_RSHUTDOWN_FUNCTION(dtoken);
+PHP_GINIT_FUNCTION(dtoken);
+
 zend_module_entry dtoken_module_entry =
 {
 	STANDARD_MODULE_HEADER,
 	"dtoken",
-	dtoken_functions,
-	NULL,
-	NULL,
+	ext_functions,
+	PHP_MINIT(dtoken),
+	PHP_MSHUTDOWN(dtoken),
+	PHP_RINIT(dtoken),
+	PHP_RSHUTDOWN(dtoken),
 	NULL,
+	VERSION,
+	PHP_MODULE_GLOBALS(dtoken),
+	PHP_GINIT(dtoken),
 	NULL,
 	NULL,
-	VERSION,
-	STANDARD_MODULE_PROPERTIES
+	STANDARD_MODULE_PROPERTIES_EX
 };
 
+#if defined(ZTS) && defined(COMPILE_DL_DTOKEN)
+ZEND_TSRMLS_CACHE_DEFINE()
+#endif
+
 ZEND_GET_MODULE(dtoken)
 
-int is_ipv4_address(char* str)
+#define INI_PLAN() ((struct encoding_plan *)(ZEND_INI_GET_BASE() + (size_t)mh_arg1))
+
+static PHP_INI_MH(OnUpdatePrecision)
 {
-	struct in_addr addr;
-	int result = inet_pton(AF_INET, str, &addr);
-	return result == 1;
+	if (!zend_string_equals_literal(new_value, "0") && !zend_string_equals_literal(new_value, "1"))
+	{
+		php_error(E_WARNING, "dtoken.precision has to be 0 or 1");
+		return FAILURE;
+	}
+
+	INI_PLAN()->time_type = ZSTR_VAL(new_value)[0] == '1';
+
+	return SUCCESS;
 }
 
-int is_ipv6_address(char* str)
+static PHP_INI_MH(OnUpdateLayout)
 {
-	struct in6_addr addr;
-	int result = inet_pton(AF_INET6, str, &addr);
-	return result == 1;
+	struct encoding_plan* plan = INI_PLAN();
+
+	if (zend_string_equals_literal(new_value, "standard"))
+	{
+		plan->flags = 0;
+	}
+	else if (zend_string_equals_literal(new_value, "sortable"))
+	{
+		plan->flags = TOKEN_SORTABLE;
+	}
+	else
+	{
+		php_error(E_WARNING, "dtoken.layout has to be standard or sortable");
+		return FAILURE;
+	}
+
+	plan->encoder = get_token_encoder(plan->encoding, plan->flags);
+
+	return SUCCESS;
 }
 
-int is_valid_ip_address(const char *ip_str)
+static PHP_INI_MH(OnUpdateEncoding)
 {
-	if (ip_str == NULL)
+	struct encoding_plan* plan = INI_PLAN();
+
+	if (zend_string_equals_literal(new_value, "base36"))
 	{
-		return 0;
+		plan->encoding = ENCODING_BASE36;
+	}
+	else if (zend_string_equals_literal(new_value, "base32"))
+	{
+		plan->encoding = ENCODING_BASE32;
+	}
+	else if (zend_string_equals_literal(new_value, "base64url"))
+	{
+		plan->encoding = ENCODING_BASE64URL;
+	}
+	else if (zend_string_equals_literal(new_value, "raw"))
+	{
+		plan->encoding = ENCODING_RAW;
+	}
+	else
+	{
+		php_error(E_WARNING, "dtoken.encoding has to be base36, base32, base64url or raw");
+		return FAILURE;
 	}
 
-	struct in_addr ipv4;
-	struct in6_addr ipv6;
+	plan->encoder = get_token_encoder(plan->encoding, plan->flags);
+
+	return SUCCESS;
+}
+
+int update_configured_segment(struct configured_segment* configured, zend_string* address, const char* name)
+{
+	struct token_address parsed;
 
-	if (inet_pton(AF_INET, ip_str, &ipv4) == 1)
+	if (ZSTR_LEN(address) == 0)
 	{
-		return 1; // Valid IPv4 address
+		configured->enabled = 0;
+		return SUCCESS;
 	}
 
-	if (inet_pton(AF_INET6, ip_str, &ipv6) == 1)
+	if (parse_address(&parsed, ZSTR_VAL(address), ZSTR_LEN(address)) != 0)
 	{
-		return 1; // Valid IPv6 address
+		php_error(E_WARNING, "%s is not a valid IPv4 or IPv6 address", name);
+		return FAILURE;
 	}
 
-	return 0; // Invalid address
+	encode_segment(&configured->segment, 1, parsed.protocol, &parsed.ip, parsed.port);
+	configured->enabled = 1;
+
+	return SUCCESS;
+}
+
+static PHP_INI_MH(OnUpdateBalancerAddress)
+{
+	return update_configured_segment(&INI_PLAN()->lb, new_value, "dtoken.balancer_address");
 }
 
-void check_address(char* addr, short int* enabled, short int* protocol, char** address)
+static PHP_INI_MH(OnUpdateServerAddress)
 {
-	zval *server_vars = &PG(http_globals)[TRACK_VARS_SERVER];
+	return update_configured_segment(&INI_PLAN()->server, new_value, "dtoken.server_address");
+}
 
-	if (addr)
+/*
+ * The prefixes are shared by every thread and only set at startup, before any
+ * address is encoded
+ */
+static PHP_INI_MH(OnUpdateIpv6Prefixes)
+{
+	if (set_ipv6_prefixes(ZSTR_VAL(new_value), ZSTR_LEN(new_value)) != 0)
 	{
-		if (is_ipv4_address(addr))
-		{
-			*enabled = 1;
-			*protocol = AF_INET;
-			*address = addr;
-		}
-		else if (is_ipv6_address(addr))
+		php_error(E_WARNING, "dtoken.ipv6_prefixes has to be a comma separated list of at most %d IPv6 prefixes", IPv6_PREFIXES);
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+/*
+ * Shared and only set at startup like the prefixes. A value starting with a
+ * slash is the path of a file holding the list.
+ */
+static PHP_INI_MH(OnUpdateAddressDictionary)
+{
+	int result;
+
+	if (ZSTR_VAL(new_value)[0] == '/')
+	{
+		php_stream* stream = php_stream_open_wrapper(ZSTR_VAL(new_value), "rb", REPORT_ERRORS, NULL);
+		zend_string* list;
+
+		if (stream == NULL)
 		{
-			*enabled = 1;
-			*protocol = AF_INET6;
-			*address = addr;
+			return FAILURE;
 		}
-		else
+
+		list = php_stream_copy_to_mem(stream, PHP_STREAM_COPY_ALL, 0);
+		php_stream_close(stream);
+
+		result = list ? set_address_dictionary(ZSTR_VAL(list), ZSTR_LEN(list)) : set_address_dictionary("", 0);
+		if (list)
 		{
-			*enabled = 0;
-			*protocol = AF_INET;
-			*address = "";
+			zend_string_release(list);
 		}
 	}
 	else
 	{
-		zval *zaddr;
-		if (server_vars && (zaddr = zend_hash_str_find(Z_ARRVAL_P(server_vars), ZEND_STRL("REMOTE_ADDR"))) != NULL)
+		result = set_address_dictionary(ZSTR_VAL(new_value), ZSTR_LEN(new_value));
+	}
+
+	if (result != 0)
+	{
+		php_error(E_WARNING, "dtoken.address_dictionary has to be a list, or the path of a file with a list, of at most %d distinct IP addresses without ports", DICTIONARY_ADDRESSES);
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+static PHP_INI_MH(OnUpdateTrustedProxies)
+{
+	if (set_trusted_proxies(ZSTR_VAL(new_value), ZSTR_LEN(new_value)) != 0)
+	{
+		php_error(E_WARNING, "dtoken.trusted_proxies has to be a comma separated list of IPv4 or IPv6 networks");
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+PHP_INI_BEGIN()
+	STD_PHP_INI_ENTRY("dtoken.precision", "0", PHP_INI_ALL, OnUpdatePrecision, plan, zend_dtoken_globals, dtoken_globals)
+	STD_PHP_INI_ENTRY("dtoken.layout", "standard", PHP_INI_ALL, OnUpdateLayout, plan, zend_dtoken_globals, dtoken_globals)
+	STD_PHP_INI_ENTRY("dtoken.encoding", "base36", PHP_INI_ALL, OnUpdateEncoding, plan, zend_dtoken_globals, dtoken_globals)
+	PHP_INI_ENTRY("dtoken.ipv6_prefixes", "", PHP_INI_SYSTEM, OnUpdateIpv6Prefixes) /* before the addresses it encodes */
+	PHP_INI_ENTRY("dtoken.address_dictionary", "", PHP_INI_SYSTEM, OnUpdateAddressDictionary) /* same */
+	PHP_INI_ENTRY("dtoken.trusted_proxies", "", PHP_INI_SYSTEM, OnUpdateTrustedProxies)
+	STD_PHP_INI_ENTRY("dtoken.balancer_address", "", PHP_INI_ALL, OnUpdateBalancerAddress, plan, zend_dtoken_globals, dtoken_globals)
+	STD_PHP_INI_ENTRY("dtoken.server_address", "", PHP_INI_ALL, OnUpdateServerAddress, plan, zend_dtoken_globals, dtoken_globals)
+	STD_PHP_INI_BOOLEAN("dtoken.auto", "0", PHP_INI_SYSTEM | PHP_INI_PERDIR, OnUpdateBool, auto_token, zend_dtoken_globals, dtoken_globals)
+PHP_INI_END()
+
+PHP_GINIT_FUNCTION(dtoken)
+{
+#if defined(ZTS) && defined(COMPILE_DL_DTOKEN)
+	ZEND_TSRMLS_CACHE_UPDATE();
+#endif
+
+	dtoken_globals->current = NULL;
+
+	// Nothing encoded yet
+	dtoken_globals->lb.enabled = -1;
+	dtoken_globals->server.enabled = -1;
+
+	// Defaults until the INI settings are read
+	dtoken_globals->plan.time_type = 0;
+	dtoken_globals->plan.flags = 0;
+	dtoken_globals->plan.encoding = ENCODING_BASE36;
+	dtoken_globals->plan.encoder = get_token_encoder(ENCODING_BASE36, 0);
+	dtoken_globals->plan.lb.enabled = 0;
+	dtoken_globals->plan.server.enabled = 0;
+
+	dtoken_globals->auto_token = 0;
+}
+
+/*
+ * Whether the token of the current request is added to the response and
+ * $_SERVER. Raw tokens are left out since they are not printable.
+ */
+int is_auto_token()
+{
+	return DTOKEN_G(auto_token) && DTOKEN_G(plan).encoding != ENCODING_RAW;
+}
+
+void register_server_variables(zval* track_vars_array)
+{
+	if (original_register_server_variables)
+	{
+		original_register_server_variables(track_vars_array);
+	}
+
+	if (is_auto_token())
+	{
+		// $_SERVER may be built before RINIT, so the token is built on first use
+		if (!DTOKEN_G(current))
 		{
-			*enabled = 1;
-			*protocol = is_ipv4_address(Z_STRVAL_P(zaddr)) == 1 ? AF_INET : AF_INET6;
-			*address = Z_STRVAL_P(zaddr);
+			DTOKEN_G(current) = get_default_token(0);
 		}
+
+		php_register_variable_safe("DTOKEN", ZSTR_VAL(DTOKEN_G(current)), ZSTR_LEN(DTOKEN_G(current)), track_vars_array);
 	}
 }
 
-char* get_token(
-	int _method,
-	short int _precision,
-	long int _timestamp,
-	char* _address,
-	char* _balancer,
-	char* _server,
-	int _id1,
-	int _id2
-)
+PHP_MINIT_FUNCTION(dtoken)
 {
-	// Request timestamp
-	_Bool time_type = (_Bool)(_precision != 0 ? 1 : 0); // default to second precision
-	long int timestamp;
-	if (_timestamp)
+	REGISTER_INI_ENTRIES();
+
+	REGISTER_LONG_CONSTANT("DTOKEN_FIXED_LENGTH", TOKEN_FIXED_LENGTH, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("DTOKEN_SORTABLE", TOKEN_SORTABLE, CONST_CS | CONST_PERSISTENT);
+
+	REGISTER_LONG_CONSTANT("DTOKEN_BASE36", ENCODING_BASE36, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("DTOKEN_BASE32", ENCODING_BASE32, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("DTOKEN_BASE64URL", ENCODING_BASE64URL, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("DTOKEN_RAW", ENCODING_RAW, CONST_CS | CONST_PERSISTENT);
+
+	register_token_class();
+	register_builder_class();
+
+	original_register_server_variables = sapi_module.register_server_variables;
+	sapi_module.register_server_variables = register_server_variables;
+
+	return SUCCESS;
+}
+
+PHP_MSHUTDOWN_FUNCTION(dtoken)
+{
+	sapi_module.register_server_variables = original_register_server_variables;
+
+	UNREGISTER_INI_ENTRIES();
+
+	free_trusted_proxies();
+
+	return SUCCESS;
+}
+
+PHP_RINIT_FUNCTION(dtoken)
+{
+#if defined(ZTS) && defined(COMPILE_DL_DTOKEN)
+	ZEND_TSRMLS_CACHE_UPDATE();
+#endif
+
+	if (!is_auto_token())
 	{
-		timestamp = _timestamp;
+		return SUCCESS;
 	}
-	else
+
+	if (!DTOKEN_G(current))
+	{
+		DTOKEN_G(current) = get_default_token(0);
+	}
+
+	char header[sizeof("X-Request-Token: ") + TOKEN_MAX_LENGTH];
+	size_t length = snprintf(header, sizeof(header), "X-Request-Token: %s", ZSTR_VAL(DTOKEN_G(current)));
+
+	sapi_add_header(header, length, 1);
+
+	return SUCCESS;
+}
+
+PHP_RSHUTDOWN_FUNCTION(dtoken)
+{
+	if (DTOKEN_G(current))
+	{
+		zend_string_release(DTOKEN_G(current));
+		DTOKEN_G(current) = NULL;
+	}
+
+	return SUCCESS;
+}
+
+const struct token_address* check_address(struct token_address* parsed, const char* address, size_t length, const char* name)
+{
+	if (address == NULL)
+	{
+		return NULL;
+	}
+
+	if (parse_address(parsed, address, length) != 0)
+	{
+		php_error(E_WARNING, "%s is not a valid IPv4 or IPv6 address", name);
+		return NULL;
+	}
+
+	return parsed;
+}
+
+void set_client_address(struct token_data* data, const struct token_address* address)
+{
+	data->client_enabled = address != NULL;
+	data->client_protocol = AF_INET;
+	data->client_port = 0;
+
+	if (address)
+	{
+		data->client_protocol = address->protocol;
+		memcpy(&data->client_ip, &address->ip, sizeof(address->ip));
+		data->client_port = address->port;
+	}
+}
+
+char* get_request_variable(char* name, size_t length)
+{
+	// Ask the SAPI directly, so $_SERVER is not built just for the token
+	if (sapi_module.getenv)
 	{
-		struct timeval tv;
-		gettimeofday(&tv, NULL);
-		if (time_type == 1)
+		char* value = sapi_module.getenv(name, length);
+		if (value)
 		{
-			timestamp = (tv.tv_sec + (tv.tv_usec / 1000000.0)) * 1000000;
+			return value;
 		}
-		else
+	}
+
+	// Some SAPIs only provide server variables through $_SERVER, only use it when it already exists
+	zval* server_vars = &PG(http_globals)[TRACK_VARS_SERVER];
+	if (Z_TYPE_P(server_vars) == IS_ARRAY)
+	{
+		zval* value = zend_hash_str_find(Z_ARRVAL_P(server_vars), name, length);
+		if (value && Z_TYPE_P(value) == IS_STRING)
 		{
-			timestamp = tv.tv_sec;
+			return Z_STRVAL_P(value);
 		}
 	}
 
-	// HTTP method
-	int method = 0;
-	if (_method)
+	return NULL;
+}
+
+const struct token_address* get_request_address(
+	char* address_name,
+	size_t address_length,
+	char* port_name,
+	size_t port_length,
+	struct token_address* address
+)
+{
+	char* value = get_request_variable(address_name, address_length);
+
+	if (!value || parse_address(address, value, strlen(value)) != 0)
 	{
-		method = _method;
+		return NULL;
 	}
-	else
-	{
-		const char* request_method = SG(request_info).request_method;
-
-			 if (strcmp(request_method, "GET") == 0)	 { method = GET;	 }
-		else if (strcmp(request_method, "POST") == 0)	{ method = POST;	}
-		else if (strcmp(request_method, "PUT") == 0)	 { method = PUT;	 }
-		else if (strcmp(request_method, "DELETE") == 0)  { method = DELETE;  }
-		else if (strcmp(request_method, "HEAD") == 0)	{ method = HEAD;	}
-		else if (strcmp(request_method, "CONNECT") == 0) { method = CONNECT; }
-		else if (strcmp(request_method, "OPTIONS") == 0) { method = OPTIONS; }
-		else if (strcmp(request_method, "TRACE") == 0)   { method = TRACE;   }
-		else if (strcmp(request_method, "PATCH") == 0)   { method = PATCH;   }
-	}
-
-	short int client_enabled = 0, client_protocol = AF_INET, client_port = 0;
-	char* client_address = "";
-	check_address(_address, &client_enabled, &client_protocol, &client_address);
-
-	short int lb_enabled = 0, lb_protocol = AF_INET, lb_port = 0;
-	char* lb_address = "";
-	check_address(_balancer, &lb_enabled, &lb_protocol, &lb_address);
-
-	short int server_enabled = 0, server_protocol = AF_INET, server_port = 0;
-	char* server_address = "";
-	check_address(_server, &server_enabled, &server_protocol, &server_address);
-
-	int id1 = (_id1 != 0 ? _id1 : 0);
-	int id2 = (_id2 != 0 ? _id2 : 0);
-
-	php_printf(
-		"time_type: %d\n"
-		"timestamp: %ld\n"
-		"method: %d\n"
-		"client_enabled: %d\n"
-		"client_protocol: %s\n"
-		"client_address: %s\n"
-		"client_port: %d\n"
-		"lb_enabled: %d\n"
-		"lb_protocol: %s\n"
-		"lb_address: %s\n"
-		"lb_port: %d\n"
-		"server_enabled: %d\n"
-		"server_protocol: %s\n"
-		"server_address: %s\n"
-		"server_port: %d\n"
-		"id1: %d\n"
-		"id2: %d\n",
-		(time_type ? 1 : 0),
-		timestamp,
-		method,
-		(client_enabled ? 1 : 0),
-		(client_protocol == AF_INET ? "IPv4" : "IPv6"),
-		client_address,
-		client_port,
-		(lb_enabled ? 1 : 0),
-		(lb_protocol == AF_INET ? "IPv4" : "IPv6"),
-		lb_address,
-		lb_port,
-		(server_enabled ? 1 : 0),
-		(server_protocol == AF_INET ? "IPv4" : "IPv6"),
-		server_address,
-		server_port,
-		id1,
-		id2
-	);
-
-	int buffer_size =
-		VERSION_PATCH_SIZE +
-		VERSION_MINOR_SIZE +
-		VERSION_MAJOR_SIZE +
-		TIME_TYPE_SIZE +
-		TIME_US_SIZE +
-		METHOD_SIZE +
-		ID1_SIZE +
-		ID2_SIZE +
-		((2 + PORT_SIZE) * 3) + // x number of addresses + extra bits for meta
-		((2 + IPv6_SIZE) * 3) + // x number of addresses + extra bits for meta
-		100; // Adding some extra bits for good measure
-
-	char token_buffer[buffer_size];
-
-	char* token = build(
-		token_buffer,
-		method,
-		time_type,
-		timestamp,
-		client_enabled,
-		client_protocol,
-		client_address,
-		client_port,
-		lb_enabled,
-		lb_protocol,
-		lb_address,
-		lb_port,
-		server_enabled,
-		server_protocol,
-		server_address,
-		server_port,
-		id1,
-		id2
-	);
 
-	return token;
+	// The SAPI gives the port separately
+	value = get_request_variable(port_name, port_length);
+	if (value)
+	{
+		long int number = strtol(value, NULL, 10);
+		if (number > 0 && number <= 65535)
+		{
+			address->port = (unsigned short int)number;
+		}
+	}
 
+	return address;
 }
 
-
-PHP_FUNCTION(dtoken_build)
+/*
+ * Trusted proxies, as a binary trie over the bits of their networks. Node 0
+ * is the root for IPv4 and node 1 for IPv6, and a child index of 0 means
+ * there is no child. Built at startup and only read afterwards.
+ */
+struct proxy_node
 {
-	zend_long method = 0;
-	zend_long precision = 0;
-	zend_long timestamp = 0;
-	char* address = NULL;
-	char* balancer = NULL;
-	char* server = NULL;
-	zend_long id1 = 0;
-	zend_long id2 = 0;
+	uint32_t child[2];
+	_Bool trusted; /* the bits leading here are a trusted network */
+};
 
-	zend_bool method_null;
-	zend_bool precision_null;
-	zend_bool timestamp_null;
-	zend_bool address_null;
-	zend_bool balancer_null;
-	zend_bool server_null;
-	zend_bool id1_null;
-	zend_bool id2_null;
+struct proxy_node* proxy_nodes = NULL;
+uint32_t proxy_node_count = 0;
 
-	size_t address_lennn;
-	size_t balancer_lennn;
-	size_t server_lennn;
+#define ADDRESS_BIT(bytes, i) (((bytes)[(i) >> 3] >> (7 - ((i) & 7))) & 1)
 
-	ZEND_PARSE_PARAMETERS_START(0, 8)
-		Z_PARAM_OPTIONAL
-		Z_PARAM_LONG_OR_NULL(method, method_null)
-		Z_PARAM_LONG_OR_NULL(precision, precision_null)
-		Z_PARAM_LONG_OR_NULL(timestamp, timestamp_null)
-		Z_PARAM_OPTIONAL
-		Z_PARAM_STRING_EX(address, address_lennn, 1, 1)
-		Z_PARAM_OPTIONAL
-		Z_PARAM_STRING_EX(balancer, balancer_lennn, 1, 1)
-		Z_PARAM_OPTIONAL
-		Z_PARAM_STRING_EX(server, server_lennn, 1, 1)
-		Z_PARAM_LONG_OR_NULL(id1, id1_null)
-		Z_PARAM_LONG_OR_NULL(id2, id2_null)
-	ZEND_PARSE_PARAMETERS_END();
+/* At most this many of the last hops of a forwarded header are followed */
+#define FORWARDED_HOPS 16
 
-	if (method < 0 || method > 9)
+void free_trusted_proxies()
+{
+	if (proxy_nodes)
 	{
-		method = 0;
-		php_error(E_WARNING, "$method has to be an integer from 1 to 9");
+		pefree(proxy_nodes, 1);
 	}
 
-	if (precision != 0 && precision != 1)
+	proxy_nodes = NULL;
+	proxy_node_count = 0;
+}
+
+void add_trusted_network(struct proxy_node** nodes, uint32_t* count, uint32_t* size, const unsigned char* bytes, unsigned int root, unsigned int length)
+{
+	uint32_t node = root;
+
+	for (unsigned int i = 0; i < length && !(*nodes)[node].trusted; i++)
 	{
-		precision = 0;
-		php_error(E_WARNING, "$precision has to be 0 or 1");
+		unsigned int bit = ADDRESS_BIT(bytes, i);
+
+		if (!(*nodes)[node].child[bit])
+		{
+			if (*count == *size)
+			{
+				*size *= 2;
+				*nodes = perealloc(*nodes, *size * sizeof(struct proxy_node), 1);
+			}
+
+			memset(&(*nodes)[*count], 0, sizeof(struct proxy_node));
+			(*nodes)[node].child[bit] = (*count)++;
+		}
+
+		node = (*nodes)[node].child[bit];
+	}
+
+	// Networks inside this one are covered by it
+	(*nodes)[node].trusted = 1;
+	(*nodes)[node].child[0] = 0;
+	(*nodes)[node].child[1] = 0;
+}
+
+int set_trusted_proxies(const char* list, size_t length)
+{
+	uint32_t size = 16;
+	uint32_t count = 2;
+	struct proxy_node* nodes = pecalloc(size, sizeof(struct proxy_node), 1);
+	const char* end = list + length;
+
+	while (list < end)
+	{
+		const char* item = list;
+		const char* next = memchr(list, ',', end - list);
+		const char* stop = next ? next : end;
+
+		list = next ? next + 1 : end;
+
+		while (item < stop && (*item == ' ' || *item == '\t'))
+		{
+			item++;
+		}
+		while (stop > item && (stop[-1] == ' ' || stop[-1] == '\t'))
+		{
+			stop--;
+		}
+
+		if (item == stop)
+		{
+			continue;
+		}
+
+		// A network, or a single address
+		const char* slash = memchr(item, '/', stop - item);
+		struct token_address network;
+
+		if (parse_address(&network, item, (slash ? slash : stop) - item) != 0 || network.port != 0)
+		{
+			pefree(nodes, 1);
+			return FAILURE;
+		}
+
+		unsigned int bits = network.protocol == AF_INET ? IPv4_SIZE : IPv6_SIZE;
+		unsigned int prefix = bits;
+
+		if (slash)
+		{
+			prefix = 0;
+
+			for (const char* digit = slash + 1; digit < stop; digit++)
+			{
+				if (*digit < '0' || *digit > '9' || stop - slash > 4)
+				{
+					pefree(nodes, 1);
+					return FAILURE;
+				}
+				prefix = prefix * 10 + (*digit - '0');
+			}
+
+			if (slash + 1 == stop || prefix > bits)
+			{
+				pefree(nodes, 1);
+				return FAILURE;
+			}
+		}
+
+		add_trusted_network(
+			&nodes,
+			&count,
+			&size,
+			network.protocol == AF_INET ? (const unsigned char *)&network.ip.v4 : network.ip.v6.s6_addr,
+			network.protocol == AF_INET ? 0 : 1,
+			prefix
+		);
 	}
 
-	if (address != NULL && !is_valid_ip_address(address))
+	free_trusted_proxies();
+
+	// An empty list trusts nobody, so there is nothing to look up
+	if (nodes[0].trusted || nodes[0].child[0] || nodes[0].child[1] ||
+		nodes[1].trusted || nodes[1].child[0] || nodes[1].child[1])
+	{
+		proxy_nodes = nodes;
+		proxy_node_count = count;
+	}
+	else
 	{
-		address = NULL;
-		address_lennn = 0;
-		php_error(E_WARNING, "$address is not a valid IPv4 or IPv6 address");
+		pefree(nodes, 1);
 	}
 
-	if (balancer != NULL && !is_valid_ip_address(balancer))
+	return SUCCESS;
+}
+
+int is_trusted_proxy(const struct token_address* address)
+{
+	const unsigned char* bytes = address->ip.v6.s6_addr;
+	unsigned int root = 1;
+	unsigned int length = IPv6_SIZE;
+
+	if (!proxy_nodes)
 	{
-		balancer = NULL;
-		balancer_lennn = 0;
-		php_error(E_WARNING, "$balancer is not a valid IPv4 or IPv6 address");
+		return 0;
 	}
 
-	if (server != NULL && !is_valid_ip_address(server))
+	// IPv4 clients of dual-stack sockets are looked up as IPv4
+	if (address->protocol == AF_INET)
+	{
+		bytes = (const unsigned char *)&address->ip.v4;
+		root = 0;
+		length = IPv4_SIZE;
+	}
+	else if (IN6_IS_ADDR_V4MAPPED(&address->ip.v6))
 	{
-		server = NULL;
-		server_lennn = 0;
-		php_error(E_WARNING, "$server is not a valid IPv4 or IPv6 address");
+		bytes += 12;
+		root = 0;
+		length = IPv4_SIZE;
 	}
 
-	if (id1 < 0 || id1 > (2 << ID1_SIZE) - 1)
+	uint32_t node = root;
+
+	for (unsigned int i = 0; !proxy_nodes[node].trusted; i++)
 	{
-		id1 = 0;
-		php_error(E_WARNING, "$id1 has to be an integer between 0 and %d", (2 << ID1_SIZE) - 1);
+		if (i == length || !(node = proxy_nodes[node].child[ADDRESS_BIT(bytes, i)]))
+		{
+			return 0;
+		}
 	}
 
-	if (id2 < 0 || id2 > (2 << ID2_SIZE) - 1)
+	return 1;
+}
+
+const char* skip_space(const char* str, const char* end)
+{
+	while (str < end && (*str == ' ' || *str == '\t'))
 	{
-		id2 = 0;
-		php_error(E_WARNING, "$id1 has to be an integer between 0 and %d", (2 << ID2_SIZE) - 1);
+		str++;
 	}
 
-	RETURN_STRING(get_token(method, precision, timestamp, address, balancer, server, id1, id2));
+	return str;
+}
+
+/*
+ * Finds the end of a list element or parameter, skipping quoted strings
+ */
+const char* find_separator(const char* str, const char* end, char separator)
+{
+	_Bool quoted = 0;
+
+	for (; str < end; str++)
+	{
+		if (*str == '"')
+		{
+			quoted = !quoted;
+		}
+		else if (*str == '\\' && quoted && str + 1 < end)
+		{
+			str++;
+		}
+		else if (*str == separator && !quoted)
+		{
+			break;
+		}
+	}
+
+	return str;
+}
+
+/*
+ * Gets the address in an element of a Forwarded header (RFC 7239), from its
+ * "for" parameter
+ */
+int parse_forwarded_for(struct token_address* address, const char* str, const char* end)
+{
+	while (str < end)
+	{
+		const char* stop = find_separator(str, end, ';');
+		const char* name = skip_space(str, stop);
+		const char* equals = stop - name > 3 ? skip_space(name + 3, stop) : stop;
+
+		str = stop + 1;
+
+		if (equals == stop || *equals != '=' || strncasecmp(name, "for", 3) != 0)
+		{
+			continue;
+		}
+
+		const char* value = skip_space(equals + 1, stop);
+
+		while (stop > value && (stop[-1] == ' ' || stop[-1] == '\t'))
+		{
+			stop--;
+		}
+
+		if (stop - value >= 2 && *value == '"' && stop[-1] == '"')
+		{
+			value++;
+			stop--;
+		}
+
+		// Obfuscated identifiers and "unknown" are not addresses
+		return parse_address(address, value, stop - value);
+	}
+
+	return -1;
+}
+
+const struct token_address* get_forwarded_client(struct token_address* client, const char* header, size_t length, _Bool forwarded)
+{
+	struct { const char* start; const char* end; } hops[FORWARDED_HOPS];
+	const char* end = header + length;
+	uint32_t count = 0;
+
+	// Only the last hops are kept, the ones added by proxies are at the end
+	for (;;)
+	{
+		const char* stop = find_separator(header, end, ',');
+
+		hops[count % FORWARDED_HOPS].start = header;
+		hops[count % FORWARDED_HOPS].end = stop;
+		count++;
+
+		if (stop == end)
+		{
+			break;
+		}
+		header = stop + 1;
+	}
+
+	// The client is the first address, from the right, that is not a trusted proxy
+	for (uint32_t i = count; i > 0 && count - i < FORWARDED_HOPS; i--)
+	{
+		const char* start = skip_space(hops[(i - 1) % FORWARDED_HOPS].start, hops[(i - 1) % FORWARDED_HOPS].end);
+		const char* stop = hops[(i - 1) % FORWARDED_HOPS].end;
+
+		while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t'))
+		{
+			stop--;
+		}
+
+		int result = forwarded ?
+			parse_forwarded_for(client, start, stop) :
+			parse_address(client, start, stop - start);
+
+		// A hop that cannot be read hides who came before it
+		if (result != 0)
+		{
+			return NULL;
+		}
+
+		if (i == 1 || !is_trusted_proxy(client))
+		{
+			return client;
+		}
+	}
+
+	// More trusted hops than are followed
+	return NULL;
+}
+
+const struct token_address* get_request_client(
+	struct token_address* client,
+	struct token_address* proxy,
+	const struct token_address** balancer
+)
+{
+	*balancer = NULL;
+
+	if (!get_request_address(ZEND_STRL("REMOTE_ADDR"), ZEND_STRL("REMOTE_PORT"), client))
+	{
+		return NULL;
+	}
+
+	if (!is_trusted_proxy(client))
+	{
+		return client;
+	}
+
+	// The request came through a trusted proxy, which is recorded as the load balancer
+	*proxy = *client;
+	*balancer = proxy;
+
+	_Bool forwarded = 1;
+	char* header = get_request_variable(ZEND_STRL("HTTP_FORWARDED"));
+
+	if (!header)
+	{
+		forwarded = 0;
+		header = get_request_variable(ZEND_STRL("HTTP_X_FORWARDED_FOR"));
+	}
+
+	if (!header)
+	{
+		return NULL;
+	}
+
+	return get_forwarded_client(client, header, strlen(header), forwarded);
+}
+
+#define IS_METHOD(name) (memcmp(method, name, sizeof(name)) == 0)
+
+int get_request_method()
+{
+	const char* method = SG(request_info).request_method;
+
+	if (!method)
+	{
+		return 0;
+	}
+
+	// Only compare the whole name when the length and first letter match
+	switch (strlen(method))
+	{
+		case 3:
+			if (method[0] == 'G' && IS_METHOD("GET")) { return GET; }
+			if (method[0] == 'P' && IS_METHOD("PUT")) { return PUT; }
+			break;
+
+		case 4:
+			if (method[0] == 'P' && IS_METHOD("POST")) { return POST; }
+			if (method[0] == 'H' && IS_METHOD("HEAD")) { return HEAD; }
+			break;
+
+		case 5:
+			if (method[0] == 'P' && IS_METHOD("PATCH")) { return PATCH; }
+			if (method[0] == 'T' && IS_METHOD("TRACE")) { return TRACE; }
+			break;
+
+		case 6:
+			if (method[0] == 'D' && IS_METHOD("DELETE")) { return DELETE; }
+			break;
+
+		case 7:
+			if (method[0] == 'C' && IS_METHOD("CONNECT")) { return CONNECT; }
+			if (method[0] == 'O' && IS_METHOD("OPTIONS")) { return OPTIONS; }
+			break;
+	}
+
+	return 0;
+}
+
+#undef IS_METHOD
+
+int is_valid_encoding(zend_long encoding)
+{
+	return encoding >= ENCODING_BASE36 && encoding <= ENCODING_RAW;
+}
+
+int is_same_address(const struct token_address* a, const struct token_address* b)
+{
+	return a->protocol == b->protocol &&
+		a->port == b->port &&
+		memcmp(&a->ip, &b->ip, a->protocol == AF_INET ? sizeof(a->ip.v4) : sizeof(a->ip.v6)) == 0;
+}
+
+const struct token_segment* get_segment(struct segment_cache* cache, const struct token_address* address)
+{
+	// Only encode the address when it changes
+	if (address == NULL && cache->enabled != 0)
+	{
+		encode_segment(&cache->segment, 0, AF_INET, NULL, 0);
+		cache->enabled = 0;
+	}
+	else if (address != NULL && (cache->enabled != 1 || !is_same_address(&cache->address, address)))
+	{
+		encode_segment(&cache->segment, 1, address->protocol, (void *)&address->ip, address->port);
+		cache->enabled = 1;
+		cache->address = *address;
+	}
+
+	return &cache->segment;
+}
+
+long int get_timestamp(_Bool time_type)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+
+	if (time_type == 1)
+	{
+		return (tv.tv_sec + (tv.tv_usec / 1000000.0)) * 1000000;
+	}
+
+	return tv.tv_sec;
+}
+
+zend_string* encode_token_data(struct token_data* data, int flags, int encoding, token_encoder encoder)
+{
+	struct token_bits bits = { { 0 }, 0 };
+	add_token_data(&bits, data);
+
+	// Encode straight into a string of the right length (or one over, for base 36)
+	zend_string* token = zend_string_alloc(encoded_length(&bits, encoding, flags), 0);
+	ZSTR_LEN(token) = encoder(ZSTR_VAL(token), &bits);
+
+	return token;
+}
+
+zend_string* get_token(
+	int _method,
+	short int _precision,
+	long int _timestamp,
+	const struct token_address* _address,
+	const struct token_address* _balancer,
+	const struct token_address* _server,
+	int _id1,
+	int _id2,
+	int _flags,
+	int _encoding,
+	token_encoder _encoder
+)
+{
+	// Request timestamp
+	_Bool time_type = (_Bool)(_precision != 0 ? 1 : 0); // default to second precision
+	long int timestamp = _timestamp ? _timestamp : get_timestamp(time_type);
+
+	// HTTP method
+	int method = _method ? _method : get_request_method();
+
+	struct token_data data;
+
+	data.layout = _flags & TOKEN_SORTABLE ? LAYOUT_SORTABLE : LAYOUT_STANDARD;
+	data.time_type = time_type;
+	data.timestamp = timestamp;
+	data.method = method;
+
+	// Client, followed through trusted proxies
+	struct token_address client, proxy;
+	const struct token_address* detected_balancer = NULL;
+	if (!_address)
+	{
+		_address = get_request_client(&client, &proxy, &detected_balancer);
+	}
+	set_client_address(&data, _address);
+
+	// LB, usually the same for every request, only known when given, configured or a trusted proxy
+	if (!_balancer && DTOKEN_G(plan).lb.enabled)
+	{
+		data.lb_segment = &DTOKEN_G(plan).lb.segment;
+	}
+	else
+	{
+		data.lb_segment = get_segment(&DTOKEN_G(lb), _balancer ? _balancer : detected_balancer);
+	}
+
+	// Server, usually the same for every request
+	if (!_server && DTOKEN_G(plan).server.enabled)
+	{
+		data.server_segment = &DTOKEN_G(plan).server.segment;
+	}
+	else
+	{
+		struct token_address server;
+		if (!_server)
+		{
+			_server = get_request_address(ZEND_STRL("SERVER_ADDR"), ZEND_STRL("SERVER_PORT"), &server);
+		}
+		data.server_segment = get_segment(&DTOKEN_G(server), _server);
+	}
+
+	data.id1 = _id1;
+	data.id2 = _id2;
+
+	return encode_token_data(&data, _flags, _encoding, _encoder);
+}
+
+
+zend_long check_method(zend_long method)
+{
+	if (method < 0 || method > 9)
+	{
+		php_error(E_WARNING, "$method has to be an integer from 1 to 9");
+		return 0;
+	}
+
+	return method;
+}
+
+zend_long check_id(zend_long id, int size, const char* name)
+{
+	if (id < 0 || id > (1 << size) - 1)
+	{
+		php_error(E_WARNING, "%s has to be an integer between 0 and %d", name, (1 << size) - 1);
+		return 0;
+	}
+
+	return id;
+}
+
+zend_string* get_default_token(zend_long method)
+{
+	const struct encoding_plan* plan = &DTOKEN_G(plan);
+
+	return get_token(method, plan->time_type, 0, NULL, NULL, NULL, 0, 0, plan->flags, plan->encoding, plan->encoder);
+}
+
+void build_from_parameters(INTERNAL_FUNCTION_PARAMETERS, int binary)
+{
+	zend_long method = 0;
+	zend_long precision = 0;
+	zend_long timestamp = 0;
+	char* address = NULL;
+	char* balancer = NULL;
+	char* server = NULL;
+	zend_long id1 = 0;
+	zend_long id2 = 0;
+	zend_long flags = 0;
+	zend_long encoding = ENCODING_BASE36;
+
+	zend_bool method_null = 1;
+	zend_bool precision_null = 1;
+	zend_bool timestamp_null = 1;
+	zend_bool id1_null = 1;
+	zend_bool id2_null = 1;
+	zend_bool flags_null = 1;
+	zend_bool encoding_null = 1;
+
+	size_t address_len = 0;
+	size_t balancer_len = 0;
+	size_t server_len = 0;
+
+	ZEND_PARSE_PARAMETERS_START(0, binary ? 9 : 10)
+		Z_PARAM_OPTIONAL
+		Z_PARAM_LONG_OR_NULL(method, method_null)
+		Z_PARAM_LONG_OR_NULL(precision, precision_null)
+		Z_PARAM_LONG_OR_NULL(timestamp, timestamp_null)
+		Z_PARAM_STRING_OR_NULL(address, address_len)
+		Z_PARAM_STRING_OR_NULL(balancer, balancer_len)
+		Z_PARAM_STRING_OR_NULL(server, server_len)
+		Z_PARAM_LONG_OR_NULL(id1, id1_null)
+		Z_PARAM_LONG_OR_NULL(id2, id2_null)
+		Z_PARAM_LONG_OR_NULL(flags, flags_null)
+		Z_PARAM_LONG_OR_NULL(encoding, encoding_null)
+	ZEND_PARSE_PARAMETERS_END();
+
+	// Options left out come from php.ini
+	const struct encoding_plan* plan = &DTOKEN_G(plan);
+	if (precision_null)
+	{
+		precision = plan->time_type;
+	}
+	if (flags_null)
+	{
+		flags = plan->flags;
+	}
+	if (encoding_null)
+	{
+		encoding = plan->encoding;
+	}
+
+	method = check_method(method);
+
+	if (precision != 0 && precision != 1)
+	{
+		precision = 0;
+		php_error(E_WARNING, "$precision has to be 0 or 1");
+	}
+
+	// Addresses are parsed once here, and used as they are from then on
+	struct token_address parsed[3];
+	const struct token_address* client_address = check_address(&parsed[0], address, address_len, "$address");
+	const struct token_address* lb_address = check_address(&parsed[1], balancer, balancer_len, "$balancer");
+	const struct token_address* server_address = check_address(&parsed[2], server, server_len, "$server");
+
+	id1 = check_id(id1, ID1_SIZE, "$id1");
+	id2 = check_id(id2, ID2_SIZE, "$id2");
+
+	if (flags & ~(TOKEN_FIXED_LENGTH | TOKEN_SORTABLE))
+	{
+		flags &= TOKEN_FIXED_LENGTH | TOKEN_SORTABLE;
+		php_error(E_WARNING, "$flags can only contain DTOKEN_FIXED_LENGTH and DTOKEN_SORTABLE");
+	}
+
+	if (binary)
+	{
+		encoding = ENCODING_RAW;
+	}
+	else if (!is_valid_encoding(encoding))
+	{
+		encoding = ENCODING_BASE36;
+		php_error(E_WARNING, "$encoding has to be one of the DTOKEN_BASE36, DTOKEN_BASE32, DTOKEN_BASE64URL or DTOKEN_RAW constants");
+	}
+
+	token_encoder encoder = plan->encoder;
+	if (!flags_null || !encoding_null || binary)
+	{
+		encoder = get_token_encoder(encoding, flags);
+	}
+
+	RETURN_STR(get_token(method, precision, timestamp, client_address, lb_address, server_address, id1, id2, flags, encoding, encoder));
+}
+
+PHP_FUNCTION(dtoken_build)
+{
+	// The usual call, without arguments, skips parameter parsing
+	if (ZEND_NUM_ARGS() == 0)
+	{
+		RETURN_STR(get_default_token(0));
+	}
+
+	build_from_parameters(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0);
+}
+
+#if PHP_VERSION_ID >= 80400
+ZEND_FRAMELESS_FUNCTION(dtoken_build, 0)
+{
+	RETURN_STR(get_default_token(0));
+}
+
+ZEND_FRAMELESS_FUNCTION(dtoken_build, 1)
+{
+	zend_long method = 0;
+
+	if (Z_TYPE_P(arg1) != IS_NULL)
+	{
+		Z_FLF_PARAM_LONG(1, method);
+	}
+
+	RETURN_STR(get_default_token(check_method(method)));
+
+flf_clean:;
+}
+#endif
+
+PHP_FUNCTION(dtoken_build_binary)
+{
+	build_from_parameters(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1);
+}
+
+int get_record_long(HashTable* record, const char* name, size_t length, uint32_t row, zend_long max, zend_long* value)
+{
+	zval* field = zend_hash_str_find_deref(record, name, length);
+
+	if (!field || Z_TYPE_P(field) == IS_NULL)
+	{
+		return 0;
+	}
+
+	if (Z_TYPE_P(field) != IS_LONG || Z_LVAL_P(field) < 0 || Z_LVAL_P(field) > max)
+	{
+		php_error(E_WARNING, "%s of record %" PRIu32 " has to be an integer from 0 to " ZEND_LONG_FMT, name, row, max);
+		return 0;
+	}
+
+	*value = Z_LVAL_P(field);
+
+	return 1;
+}
+
+const struct token_segment* get_record_segment(
+	HashTable* record,
+	const char* name,
+	size_t length,
+	uint32_t row,
+	struct segment_cache* cache,
+	const struct configured_segment* configured
+)
+{
+	zval* field = zend_hash_str_find_deref(record, name, length);
+	struct token_address parsed;
+
+	if (!field || Z_TYPE_P(field) == IS_NULL)
+	{
+		return configured->enabled ? &configured->segment : get_segment(cache, NULL);
+	}
+
+	// Records usually share these addresses, the segment is only encoded again when the parsed address changes
+	if (Z_TYPE_P(field) != IS_STRING || parse_address(&parsed, Z_STRVAL_P(field), Z_STRLEN_P(field)) != 0)
+	{
+		php_error(E_WARNING, "%s of record %" PRIu32 " is not a valid IPv4 or IPv6 address", name, row);
+		return get_segment(cache, NULL);
+	}
+
+	return get_segment(cache, &parsed);
+}
+
+PHP_FUNCTION(dtoken_build_many)
+{
+	HashTable* records;
+	zend_long flags = 0;
+	zend_long encoding = ENCODING_BASE36;
+	zend_bool flags_null = 1;
+	zend_bool encoding_null = 1;
+	zval* entry;
+
+	ZEND_PARSE_PARAMETERS_START(1, 3)
+		Z_PARAM_ARRAY_HT(records)
+		Z_PARAM_OPTIONAL
+		Z_PARAM_LONG_OR_NULL(flags, flags_null)
+		Z_PARAM_LONG_OR_NULL(encoding, encoding_null)
+	ZEND_PARSE_PARAMETERS_END();
+
+	// Options are checked once for the whole batch
+	const struct encoding_plan* plan = &DTOKEN_G(plan);
+	if (flags_null)
+	{
+		flags = plan->flags;
+	}
+	if (encoding_null)
+	{
+		encoding = plan->encoding;
+	}
+
+	if (flags & ~(TOKEN_FIXED_LENGTH | TOKEN_SORTABLE))
+	{
+		flags &= TOKEN_FIXED_LENGTH | TOKEN_SORTABLE;
+		php_error(E_WARNING, "$flags can only contain DTOKEN_FIXED_LENGTH and DTOKEN_SORTABLE");
+	}
+
+	if (!is_valid_encoding(encoding))
+	{
+		encoding = ENCODING_BASE36;
+		php_error(E_WARNING, "$encoding has to be one of the DTOKEN_BASE36, DTOKEN_BASE32, DTOKEN_BASE64URL or DTOKEN_RAW constants");
+	}
+
+	token_encoder encoder = get_token_encoder(encoding, flags);
+
+	// Load balancer and server segments, reused while records share an address
+	struct segment_cache lb, server;
+	lb.enabled = -1;
+	server.enabled = -1;
+
+	struct token_data data;
+	data.layout = flags & TOKEN_SORTABLE ? LAYOUT_SORTABLE : LAYOUT_STANDARD;
+
+	array_init_size(return_value, zend_hash_num_elements(records));
+	zend_hash_real_init_packed(Z_ARRVAL_P(return_value));
+
+	uint32_t row = 0;
+
+	ZEND_HASH_FOREACH_VAL(records, entry)
+	{
+		ZVAL_DEREF(entry);
+
+		if (Z_TYPE_P(entry) != IS_ARRAY)
+		{
+			php_error(E_WARNING, "record %" PRIu32 " has to be an array", row);
+			add_next_index_null(return_value);
+			row++;
+			continue;
+		}
+
+		HashTable* record = Z_ARRVAL_P(entry);
+		zend_long method = 0, precision = plan->time_type, timestamp = 0, id1 = 0, id2 = 0;
+
+		get_record_long(record, ZEND_STRL("method"), row, 9, &method);
+		get_record_long(record, ZEND_STRL("precision"), row, 1, &precision);
+		get_record_long(record, ZEND_STRL("timestamp"), row, ZEND_LONG_MAX, &timestamp);
+		get_record_long(record, ZEND_STRL("id1"), row, (1 << ID1_SIZE) - 1, &id1);
+		get_record_long(record, ZEND_STRL("id2"), row, (1 << ID2_SIZE) - 1, &id2);
+
+		data.time_type = precision;
+		data.timestamp = timestamp ? timestamp : get_timestamp(precision);
+		data.method = method;
+
+		// Client, parsed and checked in one step
+		zval* address = zend_hash_str_find_deref(record, ZEND_STRL("address"));
+		struct token_address client;
+		if (address && Z_TYPE_P(address) == IS_STRING && parse_address(&client, Z_STRVAL_P(address), Z_STRLEN_P(address)) == 0)
+		{
+			set_client_address(&data, &client);
+		}
+		else
+		{
+			if (address && Z_TYPE_P(address) != IS_NULL)
+			{
+				php_error(E_WARNING, "address of record %" PRIu32 " is not a valid IPv4 or IPv6 address", row);
+			}
+			set_client_address(&data, NULL);
+		}
+
+		data.lb_segment = get_record_segment(record, ZEND_STRL("balancer"), row, &lb, &plan->lb);
+		data.server_segment = get_record_segment(record, ZEND_STRL("server"), row, &server, &plan->server);
+
+		data.id1 = id1;
+		data.id2 = id2;
+
+		add_next_index_str(return_value, encode_token_data(&data, flags, encoding, encoder));
+		row++;
+	}
+	ZEND_HASH_FOREACH_END();
+}
+
+PHP_FUNCTION(dtoken_current)
+{
+	ZEND_PARSE_PARAMETERS_NONE();
+
+	// Build once per request, later calls share the same string
+	if (!DTOKEN_G(current))
+	{
+		DTOKEN_G(current) = get_default_token(0);
+	}
+
+	RETURN_STR_COPY(DTOKEN_G(current));
+}
+
+PHP_FUNCTION(dtoken_convert)
+{
+	char* token;
+	size_t token_len;
+	zend_long from;
+	zend_long to;
+	zend_long flags = 0;
+
+	ZEND_PARSE_PARAMETERS_START(3, 4)
+		Z_PARAM_STRING(token, token_len)
+		Z_PARAM_LONG(from)
+		Z_PARAM_LONG(to)
+		Z_PARAM_OPTIONAL
+		Z_PARAM_LONG(flags)
+	ZEND_PARSE_PARAMETERS_END();
+
+	if (!is_valid_encoding(from) || !is_valid_encoding(to))
+	{
+		php_error(E_WARNING, "$from and $to have to be one of the DTOKEN_BASE36, DTOKEN_BASE32, DTOKEN_BASE64URL or DTOKEN_RAW constants");
+		RETURN_FALSE;
+	}
+
+	char converted[TOKEN_MAX_LENGTH + 1];
+	size_t length = convert_token(converted, token, token_len, from, to, flags & TOKEN_FIXED_LENGTH);
+
+	if (!length)
+	{
+		php_error(E_WARNING, "$token is not a valid token");
+		RETURN_FALSE;
+	}
+
+	RETURN_STRINGL(converted, length);
+}
+
+void add_address_to_array(
+	zval* array,
+	const char* name,
+	const char* port_name,
+	short int enabled,
+	short int protocol,
+	void* ip,
+	short int port
+)
+{
+	char address[INET6_ADDRSTRLEN];
+
+	if (!enabled)
+	{
+		add_assoc_null(array, name);
+		add_assoc_null(array, port_name);
+		return;
+	}
+
+	inet_ntop(protocol, ip, address, sizeof(address));
+	add_assoc_string(array, name, address);
+
+	if (port)
+	{
+		add_assoc_long(array, port_name, (unsigned short)port);
+	}
+	else
+	{
+		add_assoc_null(array, port_name);
+	}
+}
+
+PHP_FUNCTION(dtoken_parse)
+{
+	char* token;
+	size_t token_len;
+	zend_long encoding = ENCODING_BASE36;
+	struct token_data data;
+
+	ZEND_PARSE_PARAMETERS_START(1, 2)
+		Z_PARAM_STRING(token, token_len)
+		Z_PARAM_OPTIONAL
+		Z_PARAM_LONG(encoding)
+	ZEND_PARSE_PARAMETERS_END();
+
+	if (!is_valid_encoding(encoding))
+	{
+		php_error(E_WARNING, "$encoding has to be one of the DTOKEN_BASE36, DTOKEN_BASE32, DTOKEN_BASE64URL or DTOKEN_RAW constants");
+		RETURN_FALSE;
+	}
+
+	if (parse(&data, token, token_len, encoding) != 0)
+	{
+		php_error(E_WARNING, "$token is not a valid token");
+		RETURN_FALSE;
+	}
+
+	array_init_size(return_value, 11);
+
+	add_assoc_long(return_value, "precision", data.time_type);
+	add_assoc_long(return_value, "timestamp", data.timestamp);
+	add_assoc_long(return_value, "method", data.method);
+
+	add_address_to_array(return_value, "address", "address_port", data.client_enabled, data.client_protocol, &data.client_ip, data.client_port);
+	add_address_to_array(return_value, "balancer", "balancer_port", data.lb_enabled, data.lb_protocol, &data.lb_ip, data.lb_port);
+	add_address_to_array(return_value, "server", "server_port", data.server_enabled, data.server_protocol, &data.server_ip, data.server_port);
+
+	if (data.id1)
+	{
+		add_assoc_long(return_value, "id1", data.id1);
+	}
+	else
+	{
+		add_assoc_null(return_value, "id1");
+	}
+
+	if (data.id2)
+	{
+		add_assoc_long(return_value, "id2", data.id2);
+	}
+	else
+	{
+		add_assoc_null(return_value, "id2");
+	}
+}
+
+/*
+ * An address column of the dtoken_parse_many() result. Consecutive rows with
+ * the same address share one string.
+ */
+struct address_column
+{
+	zval addresses;
+	zval ports;
+	zend_string* last;
+	short int last_protocol;
+	union { struct in_addr v4; struct in6_addr v6; } last_ip;
+};
+
+void init_address_column(struct address_column* column, uint32_t size)
+{
+	array_init_size(&column->addresses, size);
+	zend_hash_real_init_packed(Z_ARRVAL(column->addresses));
+	array_init_size(&column->ports, size);
+	zend_hash_real_init_packed(Z_ARRVAL(column->ports));
+	column->last = NULL;
+}
+
+void add_address_to_column(
+	struct address_column* column,
+	short int enabled,
+	short int protocol,
+	void* ip,
+	short int port
+)
+{
+	if (!enabled)
+	{
+		add_next_index_null(&column->addresses);
+		add_next_index_null(&column->ports);
+		return;
+	}
+
+	size_t ip_size = protocol == AF_INET ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+
+	if (column->last && column->last_protocol == protocol && memcmp(&column->last_ip, ip, ip_size) == 0)
+	{
+		add_next_index_str(&column->addresses, zend_string_copy(column->last));
+	}
+	else
+	{
+		char address[INET6_ADDRSTRLEN];
+		inet_ntop(protocol, ip, address, sizeof(address));
+
+		column->last = zend_string_init(address, strlen(address), 0);
+		column->last_protocol = protocol;
+		memcpy(&column->last_ip, ip, ip_size);
+
+		add_next_index_str(&column->addresses, column->last);
+	}
+
+	if (port)
+	{
+		add_next_index_long(&column->ports, (unsigned short)port);
+	}
+	else
+	{
+		add_next_index_null(&column->ports);
+	}
+}
+
+PHP_FUNCTION(dtoken_parse_many)
+{
+	HashTable* tokens;
+	zend_long encoding = ENCODING_BASE36;
+	zval* entry;
+	struct token_data data;
+
+	ZEND_PARSE_PARAMETERS_START(1, 2)
+		Z_PARAM_ARRAY_HT(tokens)
+		Z_PARAM_OPTIONAL
+		Z_PARAM_LONG(encoding)
+	ZEND_PARSE_PARAMETERS_END();
+
+	if (!is_valid_encoding(encoding))
+	{
+		php_error(E_WARNING, "$encoding has to be one of the DTOKEN_BASE36, DTOKEN_BASE32, DTOKEN_BASE64URL or DTOKEN_RAW constants");
+		encoding = ENCODING_BASE36;
+	}
+
+	uint32_t count = zend_hash_num_elements(tokens);
+
+	zval precision, timestamp, method, id1, id2;
+	struct address_column client, lb, server;
+
+	array_init_size(&precision, count);
+	zend_hash_real_init_packed(Z_ARRVAL(precision));
+	array_init_size(&timestamp, count);
+	zend_hash_real_init_packed(Z_ARRVAL(timestamp));
+	array_init_size(&method, count);
+	zend_hash_real_init_packed(Z_ARRVAL(method));
+	init_address_column(&client, count);
+	init_address_column(&lb, count);
+	init_address_column(&server, count);
+	array_init_size(&id1, count);
+	zend_hash_real_init_packed(Z_ARRVAL(id1));
+	array_init_size(&id2, count);
+	zend_hash_real_init_packed(Z_ARRVAL(id2));
+
+	ZEND_HASH_FOREACH_VAL(tokens, entry)
+	{
+		ZVAL_DEREF(entry);
+
+		// Invalid tokens get null in every column, so rows stay aligned
+		if (Z_TYPE_P(entry) != IS_STRING || parse(&data, Z_STRVAL_P(entry), Z_STRLEN_P(entry), encoding) != 0)
+		{
+			add_next_index_null(&precision);
+			add_next_index_null(&timestamp);
+			add_next_index_null(&method);
+			add_address_to_column(&client, 0, AF_INET, NULL, 0);
+			add_address_to_column(&lb, 0, AF_INET, NULL, 0);
+			add_address_to_column(&server, 0, AF_INET, NULL, 0);
+			add_next_index_null(&id1);
+			add_next_index_null(&id2);
+			continue;
+		}
+
+		add_next_index_long(&precision, data.time_type);
+		add_next_index_long(&timestamp, data.timestamp);
+		add_next_index_long(&method, data.method);
+
+		add_address_to_column(&client, data.client_enabled, data.client_protocol, &data.client_ip, data.client_port);
+		add_address_to_column(&lb, data.lb_enabled, data.lb_protocol, &data.lb_ip, data.lb_port);
+		add_address_to_column(&server, data.server_enabled, data.server_protocol, &data.server_ip, data.server_port);
+
+		if (data.id1)
+		{
+			add_next_index_long(&id1, data.id1);
+		}
+		else
+		{
+			add_next_index_null(&id1);
+		}
+
+		if (data.id2)
+		{
+			add_next_index_long(&id2, data.id2);
+		}
+		else
+		{
+			add_next_index_null(&id2);
+		}
+	}
+	ZEND_HASH_FOREACH_END();
+
+	array_init_size(return_value, 11);
+
+	add_assoc_zval(return_value, "precision", &precision);
+	add_assoc_zval(return_value, "timestamp", &timestamp);
+	add_assoc_zval(return_value, "method", &method);
+	add_assoc_zval(return_value, "address", &client.addresses);
+	add_assoc_zval(return_value, "address_port", &client.ports);
+	add_assoc_zval(return_value, "balancer", &lb.addresses);
+	add_assoc_zval(return_value, "balancer_port", &lb.ports);
+	add_assoc_zval(return_value, "server", &server.addresses);
+	add_assoc_zval(return_value, "server_port", &server.ports);
+	add_assoc_zval(return_value, "id1", &id1);
+	add_assoc_zval(return_value, "id2", &id2);
+}
+
+/*
+ * Dtoken\Token properties, in the order of the dtoken_parse() keys. The client
+ * address is named client and client_port here, not address and address_port.
+ */
+#define FIELD_PRECISION 0
+#define FIELD_TIMESTAMP 1
+#define FIELD_METHOD 2
+#define FIELD_CLIENT 3
+#define FIELD_CLIENT_PORT 4
+#define FIELD_BALANCER 5
+#define FIELD_BALANCER_PORT 6
+#define FIELD_SERVER 7
+#define FIELD_SERVER_PORT 8
+#define FIELD_ID1 9
+#define FIELD_ID2 10
+#define FIELD_COUNT 11
+
+static const struct { const char* name; size_t length; } token_fields[FIELD_COUNT] =
+{
+	[FIELD_PRECISION] = { ZEND_STRL("precision") },
+	[FIELD_TIMESTAMP] = { ZEND_STRL("timestamp") },
+	[FIELD_METHOD] = { ZEND_STRL("method") },
+	[FIELD_CLIENT] = { ZEND_STRL("client") },
+	[FIELD_CLIENT_PORT] = { ZEND_STRL("client_port") },
+	[FIELD_BALANCER] = { ZEND_STRL("balancer") },
+	[FIELD_BALANCER_PORT] = { ZEND_STRL("balancer_port") },
+	[FIELD_SERVER] = { ZEND_STRL("server") },
+	[FIELD_SERVER_PORT] = { ZEND_STRL("server_port") },
+	[FIELD_ID1] = { ZEND_STRL("id1") },
+	[FIELD_ID2] = { ZEND_STRL("id2") },
+};
+
+int find_token_field(zend_string* name)
+{
+	for (int field = 0; field < FIELD_COUNT; field++)
+	{
+		if (ZSTR_LEN(name) == token_fields[field].length && memcmp(ZSTR_VAL(name), token_fields[field].name, ZSTR_LEN(name)) == 0)
+		{
+			return field;
+		}
+	}
+
+	return -1;
+}
+
+void read_token_field(struct token_object* token, int field, zval* value)
+{
+	const struct token_bits* bits = &token->bits;
+	const struct token_index* index = &token->index;
+	unsigned int offset;
+	int id;
+
+	if (!token->parsed)
+	{
+		ZVAL_NULL(value);
+		return;
+	}
+
+	switch (field)
+	{
+		case FIELD_PRECISION:
+			ZVAL_LONG(value, index->time_type);
+			return;
+
+		case FIELD_TIMESTAMP:
+			ZVAL_LONG(value, read_token_timestamp(bits, index));
+			return;
+
+		case FIELD_METHOD:
+			ZVAL_LONG(value, read_token_method(bits, index));
+			return;
+
+		case FIELD_ID1:
+		case FIELD_ID2:
+			id = field == FIELD_ID1 ? read_token_id(bits, index->id1, ID1_SIZE) : read_token_id(bits, index->id2, ID2_SIZE);
+			if (id)
+			{
+				ZVAL_LONG(value, id);
+			}
+			else
+			{
+				ZVAL_NULL(value);
+			}
+			return;
+
+		case FIELD_CLIENT:
+		case FIELD_CLIENT_PORT:
+			offset = index->client;
+			break;
+
+		case FIELD_BALANCER:
+		case FIELD_BALANCER_PORT:
+			offset = index->lb;
+			break;
+
+		default:
+			offset = index->server;
+			break;
+	}
+
+	short int enabled, protocol, port;
+	union { struct in_addr v4; struct in6_addr v6; } ip;
+	read_token_address(bits, index, offset, &enabled, &protocol, &ip, &port);
+
+	if (!enabled || ((field == FIELD_CLIENT_PORT || field == FIELD_BALANCER_PORT || field == FIELD_SERVER_PORT) && !port))
+	{
+		ZVAL_NULL(value);
+	}
+	else if (field == FIELD_CLIENT_PORT || field == FIELD_BALANCER_PORT || field == FIELD_SERVER_PORT)
+	{
+		ZVAL_LONG(value, (unsigned short)port);
+	}
+	else
+	{
+		char address[INET6_ADDRSTRLEN];
+		inet_ntop(protocol, &ip, address, sizeof(address));
+		ZVAL_STRING(value, address);
+	}
+}
+
+static zend_object* token_create(zend_class_entry* ce)
+{
+	struct token_object* token = zend_object_alloc(sizeof(struct token_object), ce);
+
+	token->parsed = 0;
+
+	zend_object_std_init(&token->std, ce);
+	object_properties_init(&token->std, ce);
+	token->std.handlers = &token_handlers;
+
+	return &token->std;
+}
+
+static zend_object* token_clone(zend_object* object)
+{
+	struct token_object* original = TOKEN_OBJECT(object);
+	zend_object* clone = token_create(object->ce);
+	struct token_object* token = TOKEN_OBJECT(clone);
+
+	token->bits = original->bits;
+	token->index = original->index;
+	token->parsed = original->parsed;
+
+	zend_objects_clone_members(clone, object);
+
+	return clone;
+}
+
+static zval* token_read_property(zend_object* object, zend_string* name, int type, void** cache_slot, zval* rv)
+{
+	int field = find_token_field(name);
+
+	if (field < 0)
+	{
+		if (type != BP_VAR_IS)
+		{
+			zend_error(E_WARNING, "Undefined property: %s::$%s", ZSTR_VAL(object->ce->name), ZSTR_VAL(name));
+		}
+		return &EG(uninitialized_zval);
+	}
+
+	read_token_field(TOKEN_OBJECT(object), field, rv);
+
+	return rv;
+}
+
+static zval* token_write_property(zend_object* object, zend_string* name, zval* value, void** cache_slot)
+{
+	zend_throw_error(NULL, "Cannot modify readonly property %s::$%s", ZSTR_VAL(object->ce->name), ZSTR_VAL(name));
+
+	return &EG(error_zval);
+}
+
+static int token_has_property(zend_object* object, zend_string* name, int has_set_exists, void** cache_slot)
+{
+	int field = find_token_field(name);
+
+	if (field < 0)
+	{
+		return 0;
+	}
+
+	if (has_set_exists == ZEND_PROPERTY_EXISTS)
+	{
+		return 1;
+	}
+
+	zval value;
+	read_token_field(TOKEN_OBJECT(object), field, &value);
+
+	int result = has_set_exists == ZEND_PROPERTY_NOT_EMPTY ? zend_is_true(&value) : Z_TYPE(value) != IS_NULL;
+	zval_ptr_dtor(&value);
+
+	return result;
+}
+
+static void token_unset_property(zend_object* object, zend_string* name, void** cache_slot)
+{
+	zend_throw_error(NULL, "Cannot unset readonly property %s::$%s", ZSTR_VAL(object->ce->name), ZSTR_VAL(name));
+}
+
+static zval* token_get_property_ptr_ptr(zend_object* object, zend_string* name, int type, void** cache_slot)
+{
+	// Fall back to the read and write handlers
+	return NULL;
+}
+
+/* Every field of the token, decoded, in a new array */
+HashTable* read_token_fields(struct token_object* token)
+{
+	HashTable* fields = zend_new_array(FIELD_COUNT);
+	zval value;
+
+	for (int field = 0; field < FIELD_COUNT; field++)
+	{
+		read_token_field(token, field, &value);
+		zend_hash_str_add_new(fields, token_fields[field].name, token_fields[field].length, &value);
+	}
+
+	return fields;
+}
+
+/* var_dump(), print_r() and debug_zval_dump() */
+static HashTable* token_get_debug_info(zend_object* object, int* is_temp)
+{
+	*is_temp = 1;
+
+	return read_token_fields(TOKEN_OBJECT(object));
+}
+
+/*
+ * (array) casts, var_export() and json_encode(), which would otherwise see no
+ * properties. Other uses, such as foreach, keep the empty standard table.
+ */
+static HashTable* token_get_properties_for(zend_object* object, zend_prop_purpose purpose)
+{
+	switch (purpose)
+	{
+		case ZEND_PROP_PURPOSE_ARRAY_CAST:
+		case ZEND_PROP_PURPOSE_VAR_EXPORT:
+		case ZEND_PROP_PURPOSE_JSON:
+			return read_token_fields(TOKEN_OBJECT(object));
+
+		default:
+			// ZEND_PROP_PURPOSE_DEBUG goes to token_get_debug_info()
+			return zend_std_get_properties_for(object, purpose);
+	}
+}
+
+void register_token_class()
+{
+	token_ce = register_class_Dtoken_Token();
+	token_ce->create_object = token_create;
+
+	memcpy(&token_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+	token_handlers.offset = XtOffsetOf(struct token_object, std);
+	token_handlers.clone_obj = token_clone;
+	token_handlers.read_property = token_read_property;
+	token_handlers.write_property = token_write_property;
+	token_handlers.has_property = token_has_property;
+	token_handlers.unset_property = token_unset_property;
+	token_handlers.get_property_ptr_ptr = token_get_property_ptr_ptr;
+	token_handlers.get_debug_info = token_get_debug_info;
+	token_handlers.get_properties_for = token_get_properties_for;
+}
+
+PHP_METHOD(Dtoken_Token, __construct)
+{
+	char* token;
+	size_t token_len;
+	zend_long encoding = ENCODING_BASE36;
+
+	ZEND_PARSE_PARAMETERS_START(1, 2)
+		Z_PARAM_STRING(token, token_len)
+		Z_PARAM_OPTIONAL
+		Z_PARAM_LONG(encoding)
+	ZEND_PARSE_PARAMETERS_END();
+
+	struct token_object* object = TOKEN_OBJECT(Z_OBJ_P(ZEND_THIS));
+	object->parsed = 0;
+
+	if (!is_valid_encoding(encoding))
+	{
+		zend_argument_value_error(2, "must be one of the DTOKEN_BASE36, DTOKEN_BASE32, DTOKEN_BASE64URL or DTOKEN_RAW constants");
+		RETURN_THROWS();
+	}
+
+	// Only the flags are read here, the fields are read when accessed
+	if (decode_token(&object->bits, token, token_len, encoding) != 0 || index_token(&object->index, &object->bits) != 0)
+	{
+		zend_argument_value_error(1, "is not a valid token");
+		RETURN_THROWS();
+	}
+
+	object->parsed = 1;
+}
+
+static zend_object* builder_create(zend_class_entry* ce)
+{
+	struct builder_object* builder = zend_object_alloc(sizeof(struct builder_object), ce);
+	const struct encoding_plan* plan = &DTOKEN_G(plan);
+
+	// Usable even if the constructor is never called
+	builder->time_type = plan->time_type;
+	builder->flags = plan->flags;
+	builder->encoding = plan->encoding;
+	builder->encoder = plan->encoder;
+	encode_segment(&builder->lb, 0, AF_INET, NULL, 0);
+	encode_segment(&builder->server, 0, AF_INET, NULL, 0);
+
+	zend_object_std_init(&builder->std, ce);
+	object_properties_init(&builder->std, ce);
+	builder->std.handlers = &builder_handlers;
+
+	return &builder->std;
+}
+
+static zend_object* builder_clone(zend_object* object)
+{
+	struct builder_object* original = BUILDER_OBJECT(object);
+	zend_object* clone = builder_create(object->ce);
+	struct builder_object* builder = BUILDER_OBJECT(clone);
+
+	builder->time_type = original->time_type;
+	builder->flags = original->flags;
+	builder->encoding = original->encoding;
+	builder->encoder = original->encoder;
+	builder->lb = original->lb;
+	builder->server = original->server;
+
+	zend_objects_clone_members(clone, object);
+
+	return clone;
+}
+
+void register_builder_class()
+{
+	builder_ce = register_class_Dtoken_Builder();
+	builder_ce->create_object = builder_create;
+
+	memcpy(&builder_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+	builder_handlers.offset = XtOffsetOf(struct builder_object, std);
+	builder_handlers.clone_obj = builder_clone;
+}
+
+int init_builder_segment(
+	struct token_segment* segment,
+	const struct configured_segment* configured,
+	char* address,
+	size_t length,
+	uint32_t arg_num
+)
+{
+	struct token_address parsed;
+
+	if (!address)
+	{
+		// Fall back to php.ini, never to the SAPI
+		if (configured->enabled)
+		{
+			*segment = configured->segment;
+		}
+		else
+		{
+			encode_segment(segment, 0, AF_INET, NULL, 0);
+		}
+		return SUCCESS;
+	}
+
+	if (parse_address(&parsed, address, length) != 0)
+	{
+		zend_argument_value_error(arg_num, "is not a valid IPv4 or IPv6 address");
+		return FAILURE;
+	}
+
+	encode_segment(segment, 1, parsed.protocol, &parsed.ip, parsed.port);
+
+	return SUCCESS;
+}
+
+PHP_METHOD(Dtoken_Builder, __construct)
+{
+	zend_long precision = 0;
+	char* balancer = NULL;
+	char* server = NULL;
+	zend_long flags = 0;
+	zend_long encoding = ENCODING_BASE36;
+
+	zend_bool precision_null = 1;
+	zend_bool flags_null = 1;
+	zend_bool encoding_null = 1;
+
+	size_t balancer_len = 0;
+	size_t server_len = 0;
+
+	ZEND_PARSE_PARAMETERS_START(0, 5)
+		Z_PARAM_OPTIONAL
+		Z_PARAM_LONG_OR_NULL(precision, precision_null)
+		Z_PARAM_STRING_OR_NULL(balancer, balancer_len)
+		Z_PARAM_STRING_OR_NULL(server, server_len)
+		Z_PARAM_LONG_OR_NULL(flags, flags_null)
+		Z_PARAM_LONG_OR_NULL(encoding, encoding_null)
+	ZEND_PARSE_PARAMETERS_END();
+
+	struct builder_object* builder = BUILDER_OBJECT(Z_OBJ_P(ZEND_THIS));
+	const struct encoding_plan* plan = &DTOKEN_G(plan);
+
+	if (!precision_null && precision != 0 && precision != 1)
+	{
+		zend_argument_value_error(1, "must be 0 or 1");
+		RETURN_THROWS();
+	}
+
+	if (!flags_null && (flags & ~(TOKEN_FIXED_LENGTH | TOKEN_SORTABLE)))
+	{
+		zend_argument_value_error(4, "can only contain DTOKEN_FIXED_LENGTH and DTOKEN_SORTABLE");
+		RETURN_THROWS();
+	}
+
+	if (!encoding_null && !is_valid_encoding(encoding))
+	{
+		zend_argument_value_error(5, "must be one of the DTOKEN_BASE36, DTOKEN_BASE32, DTOKEN_BASE64URL or DTOKEN_RAW constants");
+		RETURN_THROWS();
+	}
+
+	if (init_builder_segment(&builder->lb, &plan->lb, balancer, balancer_len, 2) == FAILURE ||
+		init_builder_segment(&builder->server, &plan->server, server, server_len, 3) == FAILURE)
+	{
+		RETURN_THROWS();
+	}
+
+	builder->time_type = precision_null ? plan->time_type : precision;
+	builder->flags = flags_null ? plan->flags : flags;
+	builder->encoding = encoding_null ? plan->encoding : encoding;
+	builder->encoder = get_token_encoder(builder->encoding, builder->flags);
+}
+
+PHP_METHOD(Dtoken_Builder, build)
+{
+	zend_long method = 0;
+	zend_long timestamp = 0;
+	char* address = NULL;
+	zend_long id1 = 0;
+	zend_long id2 = 0;
+
+	zend_bool method_null = 1;
+	zend_bool timestamp_null = 1;
+	zend_bool id1_null = 1;
+	zend_bool id2_null = 1;
+
+	size_t address_len = 0;
+
+	ZEND_PARSE_PARAMETERS_START(0, 5)
+		Z_PARAM_OPTIONAL
+		Z_PARAM_LONG_OR_NULL(method, method_null)
+		Z_PARAM_LONG_OR_NULL(timestamp, timestamp_null)
+		Z_PARAM_STRING_OR_NULL(address, address_len)
+		Z_PARAM_LONG_OR_NULL(id1, id1_null)
+		Z_PARAM_LONG_OR_NULL(id2, id2_null)
+	ZEND_PARSE_PARAMETERS_END();
+
+	struct builder_object* builder = BUILDER_OBJECT(Z_OBJ_P(ZEND_THIS));
+	struct token_data data;
+
+	data.layout = builder->flags & TOKEN_SORTABLE ? LAYOUT_SORTABLE : LAYOUT_STANDARD;
+	data.time_type = builder->time_type;
+	data.timestamp = timestamp ? timestamp : get_timestamp(builder->time_type);
+	data.method = check_method(method);
+
+	// Only the client address is parsed for each token
+	struct token_address client;
+	set_client_address(&data, check_address(&client, address, address_len, "$address"));
+
+	data.lb_segment = &builder->lb;
+	data.server_segment = &builder->server;
+
+	data.id1 = check_id(id1, ID1_SIZE, "$id1");
+	data.id2 = check_id(id2, ID2_SIZE, "$id2");
+
+	RETURN_STR(encode_token_data(&data, builder->flags, builder->encoding, builder->encoder));
 }
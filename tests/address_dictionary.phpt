@@ -0,0 +1,43 @@
+--TEST--
+Load balancer and server addresses in the dictionary are stored as their index
+--EXTENSIONS--
+dtoken
+--INI--
+dtoken.address_dictionary={PWD}/address_dictionary.txt
+--FILE--
+<?php
+// The same token as in rejected.phpt, readable here
+var_dump(dtoken_build(1, 0, 1700000000, null, '10.0.0.1', null));
+
+// Balancers and servers in the dictionary are stored as their index, clients never are
+$known = dtoken_build(1, 0, 1700000000, '2001:db8::2', '10.0.0.2:8080', '[2001:db8::2]:443');
+$unknown = dtoken_build(1, 0, 1700000000, '2001:db8::2', '10.0.0.3:8080', '[2001:db8::3]:443');
+var_dump(strlen($known) < strlen($unknown));
+
+$data = dtoken_parse($known);
+var_dump($data['address'], $data['balancer'], $data['balancer_port'], $data['server'], $data['server_port']);
+
+// The same in the other layout, encodings and entry points
+$data = dtoken_parse(dtoken_build(1, 0, 1700000000, null, '10.0.0.1', '2001:db8::1', null, null, DTOKEN_SORTABLE, DTOKEN_RAW), DTOKEN_RAW);
+var_dump($data['balancer'], $data['server']);
+
+$builder = new Dtoken\Builder(null, '10.0.0.2', '2001:db8::1');
+$data = dtoken_parse($builder->build(1, 1700000000));
+var_dump($data['balancer'], $data['server']);
+
+$data = dtoken_parse(dtoken_build_many([['timestamp' => 1700000000, 'server' => '2001:db8::2']])[0]);
+var_dump($data['server']);
+?>
+--EXPECT--
+string(12) "35jeo8oe1usg"
+bool(true)
+string(11) "2001:db8::2"
+string(8) "10.0.0.2"
+int(8080)
+string(11) "2001:db8::2"
+int(443)
+string(8) "10.0.0.1"
+string(11) "2001:db8::1"
+string(8) "10.0.0.2"
+string(11) "2001:db8::1"
+string(11) "2001:db8::2"
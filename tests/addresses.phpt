@@ -0,0 +1,78 @@
+--TEST--
+Addresses with and without ports, and the ones that are rejected
+--EXTENSIONS--
+dtoken
+--FILE--
+<?php
+$addresses = [
+	'1.2.3.4',
+	'1.2.3.4:65535',
+	'::ffff:1.2.3.4',
+	'[::ffff:1.2.3.4]:80',
+	'[::1]',
+	'2001:db8::1:443',
+	'[::1]:0',
+	'1.2.3.4:0',
+	'1.2.3.4:65536',
+	'1.2.3.4:',
+	'[::1]:',
+	'::1]',
+	'[::1',
+	'1.2.3.4]',
+	'01.2.3.4',
+];
+
+foreach ($addresses as $address) {
+	$data = dtoken_build(1, 0, 1700000000, $address, null, null);
+	$data = dtoken_parse($data);
+	echo $address, ' => ', var_export($data['address'], true), ' ', var_export($data['address_port'], true), "\n";
+}
+
+// Load balancer and server addresses are read the same way
+$data = dtoken_parse(dtoken_build(1, 0, 1700000000, null, '[::1]:8080', '1.2.3.4:443'));
+var_dump($data['balancer'], $data['balancer_port'], $data['server'], $data['server_port']);
+
+dtoken_build(1, 0, 1700000000, null, '1.2.3.4:', '::1]');
+?>
+--EXPECTF--
+1.2.3.4 => '1.2.3.4' NULL
+1.2.3.4:65535 => '1.2.3.4' 65535
+::ffff:1.2.3.4 => '::ffff:1.2.3.4' NULL
+[::ffff:1.2.3.4]:80 => '::ffff:1.2.3.4' 80
+[::1] => '::1' NULL
+2001:db8::1:443 => '2001:db8::1:443' NULL
+
+Warning: dtoken_build(): $address is not a valid IPv4 or IPv6 address in %s on line %d
+[::1]:0 => NULL NULL
+
+Warning: dtoken_build(): $address is not a valid IPv4 or IPv6 address in %s on line %d
+1.2.3.4:0 => NULL NULL
+
+Warning: dtoken_build(): $address is not a valid IPv4 or IPv6 address in %s on line %d
+1.2.3.4:65536 => NULL NULL
+
+Warning: dtoken_build(): $address is not a valid IPv4 or IPv6 address in %s on line %d
+1.2.3.4: => NULL NULL
+
+Warning: dtoken_build(): $address is not a valid IPv4 or IPv6 address in %s on line %d
+[::1]: => NULL NULL
+
+Warning: dtoken_build(): $address is not a valid IPv4 or IPv6 address in %s on line %d
+::1] => NULL NULL
+
+Warning: dtoken_build(): $address is not a valid IPv4 or IPv6 address in %s on line %d
+[::1 => NULL NULL
+
+Warning: dtoken_build(): $address is not a valid IPv4 or IPv6 address in %s on line %d
+1.2.3.4] => NULL NULL
+
+Warning: dtoken_build(): $address is not a valid IPv4 or IPv6 address in %s on line %d
+01.2.3.4 => NULL NULL
+string(3) "::1"
+int(8080)
+string(7) "1.2.3.4"
+int(443)
+
+Warning: dtoken_build(): $balancer is not a valid IPv4 or IPv6 address in %s on line %d
+
+Warning: dtoken_build(): $server is not a valid IPv4 or IPv6 address in %s on line %d
@@ -0,0 +1,56 @@
+--TEST--
+dtoken_build_many() builds one token per record
+--EXTENSIONS--
+dtoken
+--FILE--
+<?php
+$records = [
+	'first' => ['method' => 1, 'precision' => 0, 'timestamp' => 1700000000, 'address' => '1.2.3.4:80',
+		'balancer' => '10.0.0.1', 'server' => '[2001:db8::1]:443', 'id1' => 5],
+	'not an array' => 'GET /',
+	'invalid address' => ['method' => 2, 'timestamp' => 1700000001, 'address' => '1.2.3', 'balancer' => '10.0.0.1', 'id2' => 3],
+	'invalid method' => ['method' => 10, 'timestamp' => 1700000002],
+];
+
+$tokens = dtoken_build_many($records);
+var_dump(array_keys($tokens), $tokens[1]);
+
+// The same tokens as dtoken_build() with the same fields
+var_dump($tokens[0] === dtoken_build(1, 0, 1700000000, '1.2.3.4:80', '10.0.0.1', '[2001:db8::1]:443', 5, null));
+var_dump($tokens[2] === dtoken_build(2, 0, 1700000001, null, '10.0.0.1', null, null, 3));
+var_dump($tokens[3] === dtoken_build(null, 0, 1700000002, null, null, null));
+
+$tokens = dtoken_build_many([$records['first'], $records['first']], DTOKEN_FIXED_LENGTH, DTOKEN_BASE32);
+var_dump(strlen($tokens[0]), $tokens[0] === $tokens[1], dtoken_parse($tokens[1], DTOKEN_BASE32)['server_port']);
+
+var_dump(dtoken_build_many([]));
+var_dump(count(dtoken_build_many([['timestamp' => 1700000000]], 4)));
+?>
+--EXPECTF--
+Warning: dtoken_build_many(): record 1 has to be an array in %s on line %d
+
+Warning: dtoken_build_many(): address of record 2 is not a valid IPv4 or IPv6 address in %s on line %d
+
+Warning: dtoken_build_many(): method of record 3 has to be an integer from 0 to 9 in %s on line %d
+array(4) {
+  [0]=>
+  int(0)
+  [1]=>
+  int(1)
+  [2]=>
+  int(2)
+  [3]=>
+  int(3)
+}
+NULL
+bool(true)
+bool(true)
+bool(true)
+int(112)
+bool(true)
+int(443)
+array(0) {
+}
+
+Warning: dtoken_build_many(): $flags can only contain DTOKEN_FIXED_LENGTH and DTOKEN_SORTABLE in %s on line %d
+int(1)
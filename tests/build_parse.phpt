@@ -0,0 +1,63 @@
+--TEST--
+dtoken_build() and dtoken_parse() round trips in every encoding and layout
+--EXTENSIONS--
+dtoken
+--FILE--
+<?php
+$cases = [
+	// method, precision, timestamp, address, balancer, server, id1, id2, expected address fields
+	[1, 0, 1700000000, '1.2.3.4', null, null, null, null,
+		['1.2.3.4', null, null, null, null, null]],
+	[9, 1, 1700000000123456, '[2001:db8::1]:443', '10.0.0.1:8080', '[::1]:65535', 8388607, 32767,
+		['2001:db8::1', 443, '10.0.0.1', 8080, '::1', 65535]],
+	[4, 0, 4294967295, '::ffff:192.0.2.1', '::', '255.255.255.255:1', 1, null,
+		['::ffff:192.0.2.1', null, '::', null, '255.255.255.255', 1]],
+	[2, 1, 1, null, null, '2001:db8:ffff:ffff:ffff:ffff:ffff:ffff', null, 1,
+		[null, null, null, null, '2001:db8:ffff:ffff:ffff:ffff:ffff:ffff', null]],
+];
+
+// Longest length and zero digit of each encoding
+$encodings = [
+	DTOKEN_BASE36 => [108, '0'],
+	DTOKEN_BASE32 => [112, '0'],
+	DTOKEN_BASE64URL => [93, 'A'],
+	DTOKEN_RAW => [70, "\0"],
+];
+$layouts = [0, DTOKEN_FIXED_LENGTH, DTOKEN_SORTABLE, DTOKEN_FIXED_LENGTH | DTOKEN_SORTABLE];
+
+foreach ($cases as $n => [$method, $precision, $timestamp, $address, $balancer, $server, $id1, $id2, $addresses]) {
+	$expected = [
+		'precision' => $precision,
+		'timestamp' => $timestamp,
+		'method' => $method,
+		'address' => $addresses[0],
+		'address_port' => $addresses[1],
+		'balancer' => $addresses[2],
+		'balancer_port' => $addresses[3],
+		'server' => $addresses[4],
+		'server_port' => $addresses[5],
+		'id1' => $id1,
+		'id2' => $id2,
+	];
+
+	foreach ($encodings as $encoding => [$length, $zero]) {
+		foreach ($layouts as $flags) {
+			$token = dtoken_build($method, $precision, $timestamp, $address, $balancer, $server, $id1, $id2, $flags, $encoding);
+
+			if (dtoken_parse($token, $encoding) !== $expected) {
+				echo "case $n, encoding $encoding, flags $flags: parsed ", var_export(dtoken_parse($token, $encoding), true), "\n";
+			}
+
+			// Padded and sortable tokens all have the longest length, padding does not change the number
+			if ($flags && (strlen($token) !== $length ||
+				ltrim($token, $zero) !== dtoken_build($method, $precision, $timestamp, $address, $balancer, $server, $id1, $id2, $flags & ~DTOKEN_FIXED_LENGTH, $encoding))) {
+				echo "case $n, encoding $encoding, flags $flags: padded to ", var_export($token, true), "\n";
+			}
+		}
+	}
+}
+
+echo "done\n";
+?>
+--EXPECT--
+done
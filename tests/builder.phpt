@@ -0,0 +1,82 @@
+--TEST--
+Dtoken\Builder keeps its settings across tokens
+--EXTENSIONS--
+dtoken
+--FILE--
+<?php
+$builder = new Dtoken\Builder(1, '10.0.0.1:8080', '[2001:db8::1]:443', DTOKEN_SORTABLE, DTOKEN_BASE32);
+
+$token = $builder->build(2, 1700000000123456, '192.0.2.1:5000', 42, 7);
+var_dump(strlen($token));
+var_dump(dtoken_parse($token, DTOKEN_BASE32));
+
+// Only the request fields change between tokens
+$data = dtoken_parse($builder->build(5, 1700000000123457, '[2001:db8::9]'), DTOKEN_BASE32);
+var_dump($data['method'], $data['address'], $data['balancer'], $data['server'], $data['id1']);
+
+$clone = clone $builder;
+var_dump($clone->build(2, 1700000000123456, '192.0.2.1:5000', 42, 7) === $token);
+
+// Without arguments the php.ini settings are used, as by dtoken_build()
+$builder = new Dtoken\Builder();
+var_dump($builder->build(1, 1700000000) === dtoken_build(1, 0, 1700000000, null, null, null));
+
+var_dump(dtoken_parse($builder->build(1, 1700000000, '1.2.3'))['address']);
+
+$invalid = [
+	[2],
+	[null, '10.0.0.1:0'],
+	[null, null, 'localhost'],
+	[null, null, null, 4],
+	[null, null, null, null, 9],
+];
+
+foreach ($invalid as $arguments) {
+	try {
+		new Dtoken\Builder(...$arguments);
+	} catch (ValueError $e) {
+		echo $e->getMessage(), "\n";
+	}
+}
+?>
+--EXPECTF--
+int(112)
+array(11) {
+  ["precision"]=>
+  int(1)
+  ["timestamp"]=>
+  int(1700000000123456)
+  ["method"]=>
+  int(2)
+  ["address"]=>
+  string(9) "192.0.2.1"
+  ["address_port"]=>
+  int(5000)
+  ["balancer"]=>
+  string(8) "10.0.0.1"
+  ["balancer_port"]=>
+  int(8080)
+  ["server"]=>
+  string(11) "2001:db8::1"
+  ["server_port"]=>
+  int(443)
+  ["id1"]=>
+  int(42)
+  ["id2"]=>
+  int(7)
+}
+int(5)
+string(11) "2001:db8::9"
+string(8) "10.0.0.1"
+string(11) "2001:db8::1"
+NULL
+bool(true)
+bool(true)
+
+Warning: Dtoken\Builder::build(): $address is not a valid IPv4 or IPv6 address in %s on line %d
+NULL
+Dtoken\Builder::__construct(): Argument #1 ($precision) must be 0 or 1
+Dtoken\Builder::__construct(): Argument #2 ($balancer) is not a valid IPv4 or IPv6 address
+Dtoken\Builder::__construct(): Argument #3 ($server) is not a valid IPv4 or IPv6 address
+Dtoken\Builder::__construct(): Argument #4 ($flags) can only contain DTOKEN_FIXED_LENGTH and DTOKEN_SORTABLE
+Dtoken\Builder::__construct(): Argument #5 ($encoding) must be one of the DTOKEN_BASE36, DTOKEN_BASE32, DTOKEN_BASE64URL or DTOKEN_RAW constants
@@ -0,0 +1,53 @@
+--TEST--
+dtoken_build_binary() and dtoken_convert() keep the token unchanged
+--EXTENSIONS--
+dtoken
+--FILE--
+<?php
+$encodings = [DTOKEN_BASE36, DTOKEN_BASE32, DTOKEN_BASE64URL, DTOKEN_RAW];
+$layouts = [0, DTOKEN_FIXED_LENGTH, DTOKEN_SORTABLE, DTOKEN_FIXED_LENGTH | DTOKEN_SORTABLE];
+
+foreach ($encodings as $from) {
+	foreach ($layouts as $flags) {
+		$token = dtoken_build(3, 1, 1700000000123456, '[2001:db8::2]:8443', '10.0.0.1', '192.0.2.7:80', 42, 7, $flags, $from);
+		$data = dtoken_parse($token, $from);
+
+		foreach ($encodings as $to) {
+			$converted = dtoken_convert($token, $from, $to, $flags & DTOKEN_FIXED_LENGTH);
+
+			if (dtoken_parse($converted, $to) !== $data) {
+				echo "$from to $to, flags $flags: the data changed\n";
+			}
+			if (dtoken_convert($converted, $to, $from, $flags & DTOKEN_FIXED_LENGTH) !== $token) {
+				echo "$from to $to and back, flags $flags: the token changed\n";
+			}
+		}
+	}
+}
+
+// Padding is only added on request, and dropped again without it
+$token = dtoken_build(1, 0, 1700000000, '1.2.3.4', null, null, null, null, 0, DTOKEN_BASE36);
+$fixed = dtoken_convert($token, DTOKEN_BASE36, DTOKEN_BASE36, DTOKEN_FIXED_LENGTH);
+var_dump(strlen($fixed), ltrim($fixed, '0') === $token);
+var_dump(dtoken_convert($fixed, DTOKEN_BASE36, DTOKEN_BASE36) === $token);
+
+// Binary tokens are raw tokens
+$binary = dtoken_build_binary(3, 1, 1700000000123456, '[2001:db8::2]:8443', '10.0.0.1', '192.0.2.7:80', 42, 7, DTOKEN_SORTABLE);
+var_dump($binary === dtoken_build(3, 1, 1700000000123456, '[2001:db8::2]:8443', '10.0.0.1', '192.0.2.7:80', 42, 7, DTOKEN_SORTABLE, DTOKEN_RAW));
+var_dump(dtoken_parse(dtoken_convert($binary, DTOKEN_RAW, DTOKEN_BASE36), DTOKEN_BASE36)['server']);
+
+var_dump(dtoken_convert('not a token!', DTOKEN_BASE36, DTOKEN_BASE32));
+var_dump(dtoken_convert($token, DTOKEN_BASE36, 5));
+?>
+--EXPECTF--
+int(108)
+bool(true)
+bool(true)
+bool(true)
+string(9) "192.0.2.7"
+
+Warning: dtoken_convert(): $token is not a valid token in %s on line %d
+bool(false)
+
+Warning: dtoken_convert(): $from and $to have to be one of the DTOKEN_BASE36, DTOKEN_BASE32, DTOKEN_BASE64URL or DTOKEN_RAW constants in %s on line %d
+bool(false)
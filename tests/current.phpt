@@ -0,0 +1,24 @@
+--TEST--
+dtoken_current() builds the request token once
+--EXTENSIONS--
+dtoken
+--FILE--
+<?php
+$before = time();
+$token = dtoken_current();
+$after = time();
+
+usleep(1100000);
+
+// Later calls return the same token, not a new one
+var_dump(dtoken_current() === $token);
+var_dump($token === dtoken_build());
+
+$data = dtoken_parse($token);
+var_dump($data['precision'], $data['timestamp'] >= $before && $data['timestamp'] <= $after);
+?>
+--EXPECT--
+bool(true)
+bool(false)
+int(0)
+bool(true)
@@ -0,0 +1,50 @@
+--TEST--
+php.ini settings are the defaults of dtoken_build()
+--EXTENSIONS--
+dtoken
+--INI--
+dtoken.precision=1
+dtoken.layout=sortable
+dtoken.encoding=base32
+dtoken.balancer_address=10.0.0.1:8080
+dtoken.server_address=[2001:db8::1]:443
+--FILE--
+<?php
+$token = dtoken_build();
+$data = dtoken_parse($token, DTOKEN_BASE32);
+var_dump(strlen($token), $data['precision'], $data['balancer'], $data['balancer_port'], $data['server'], $data['server_port']);
+
+// Arguments take precedence over the settings
+$token = dtoken_build(1, 0, 1700000000, null, null, '192.0.2.7', null, null, 0, DTOKEN_BASE36);
+$data = dtoken_parse($token);
+var_dump($data['precision'], $data['timestamp'], $data['balancer'], $data['server'], $data['server_port']);
+
+// Settings can be changed at runtime, and invalid values are refused
+var_dump(ini_set('dtoken.encoding', 'base64url'));
+var_dump(dtoken_parse(dtoken_build(), DTOKEN_BASE64URL)['server']);
+var_dump(ini_set('dtoken.layout', 'random'));
+var_dump(ini_set('dtoken.server_address', '192.0.2.256'));
+var_dump(ini_get('dtoken.layout'), ini_get('dtoken.server_address'));
+?>
+--EXPECTF--
+int(112)
+int(1)
+string(8) "10.0.0.1"
+int(8080)
+string(11) "2001:db8::1"
+int(443)
+int(0)
+int(1700000000)
+string(8) "10.0.0.1"
+string(9) "192.0.2.7"
+NULL
+string(6) "base32"
+string(11) "2001:db8::1"
+
+Warning: ini_set(): dtoken.layout has to be standard or sortable in %s on line %d
+bool(false)
+
+Warning: ini_set(): dtoken.server_address is not a valid IPv4 or IPv6 address in %s on line %d
+bool(false)
+string(8) "sortable"
+string(17) "[2001:db8::1]:443"
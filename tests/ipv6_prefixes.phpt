@@ -0,0 +1,31 @@
+--TEST--
+IPv4-mapped and known-prefix IPv6 addresses are stored compactly
+--EXTENSIONS--
+dtoken
+--INI--
+dtoken.ipv6_prefixes=2001:db8:1::/48
+--FILE--
+<?php
+// The same token as in rejected.phpt, readable here
+var_dump(dtoken_build(1, 0, 1700000000, '2001:db8:1::5', null, null));
+
+// Compact addresses make shorter tokens
+var_dump(strlen(dtoken_build(1, 0, 1700000000, '2001:db8:1::5', null, null)) < strlen(dtoken_build(1, 0, 1700000000, '2001:db8:2::5', null, null)));
+var_dump(strlen(dtoken_build(1, 0, 1700000000, '::ffff:1.2.3.4', null, null)) < strlen(dtoken_build(1, 0, 1700000000, '::fffe:1.2.3.4', null, null)));
+
+$data = dtoken_parse(dtoken_build(1, 0, 1700000000, '2001:db8:1:ffff::1', null, '[2001:db8:1::]:80', null, null, DTOKEN_SORTABLE, DTOKEN_BASE32), DTOKEN_BASE32);
+var_dump($data['address'], $data['server'], $data['server_port']);
+
+$data = dtoken_parse(dtoken_build(1, 0, 1700000000, '[::ffff:1.2.3.4]:443', '2001:db8:2::1', null));
+var_dump($data['address'], $data['address_port'], $data['balancer']);
+?>
+--EXPECT--
+string(13) "4w7wllrradb8g"
+bool(true)
+bool(true)
+string(18) "2001:db8:1:ffff::1"
+string(12) "2001:db8:1::"
+int(80)
+string(14) "::ffff:1.2.3.4"
+int(443)
+string(13) "2001:db8:2::1"
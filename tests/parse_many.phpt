@@ -0,0 +1,57 @@
+--TEST--
+dtoken_parse_many() returns one column per field
+--EXTENSIONS--
+dtoken
+--FILE--
+<?php
+$tokens = [
+	'first' => dtoken_build(1, 0, 1700000000, '1.2.3.4:80', null, null, 5, null),
+	'invalid' => 'not a token',
+	'second' => dtoken_build(2, 1, 1700000000123456, '1.2.3.4', '10.0.0.1:8080', '[2001:db8::1]:443', null, 7),
+	'not a string' => 42,
+];
+
+$columns = dtoken_parse_many($tokens);
+
+foreach ($columns as $name => $column) {
+	echo $name, ': ', json_encode($column), "\n";
+}
+
+// The rows hold what dtoken_parse() returns for each token
+$row = [];
+foreach ($columns as $name => $column) {
+	$row[$name] = $column[2];
+}
+var_dump($row === dtoken_parse($tokens['second']));
+
+var_dump(dtoken_parse_many([]) === array_fill_keys(array_keys($columns), []));
+
+$token = dtoken_build(3, 0, 1700000001, null, null, null, null, null, 0, DTOKEN_BASE32);
+var_dump(dtoken_parse_many([$token], DTOKEN_BASE32)['timestamp']);
+
+var_dump(dtoken_parse_many([$tokens['first']], 99)['method']);
+?>
+--EXPECTF--
+precision: [0,null,1,null]
+timestamp: [1700000000,null,1700000000123456,null]
+method: [1,null,2,null]
+address: ["1.2.3.4",null,"1.2.3.4",null]
+address_port: [80,null,null,null]
+balancer: [null,null,"10.0.0.1",null]
+balancer_port: [null,null,8080,null]
+server: [null,null,"2001:db8::1",null]
+server_port: [null,null,443,null]
+id1: [5,null,null,null]
+id2: [null,null,7,null]
+bool(true)
+bool(true)
+array(1) {
+  [0]=>
+  int(1700000001)
+}
+
+Warning: dtoken_parse_many(): $encoding has to be one of the DTOKEN_BASE36, DTOKEN_BASE32, DTOKEN_BASE64URL or DTOKEN_RAW constants in %s on line %d
+array(1) {
+  [0]=>
+  int(1)
+}
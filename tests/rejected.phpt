@@ -0,0 +1,67 @@
+--TEST--
+Tokens that cannot be read are rejected
+--EXTENSIONS--
+dtoken
+--FILE--
+<?php
+$tokens = [
+	// Client ::ffff:1.2.3.4, as built
+	'valid' => 'm1n304nu1sd2sobk',
+	// The valid token with compact kind 3, which does not exist
+	'unknown kind' => 'm1n31rscwlhxibkw',
+	// The valid token with version 0.3.0, which does not exist
+	'wrong version' => 'm1n304nu1sd2soc0',
+	// Client 2001:db8:1::5 built with dtoken.ipv6_prefixes=2001:db8:1::/48
+	'unknown prefix' => '4w7wllrradb8g',
+	// Balancer 10.0.0.1 built with dtoken.address_dictionary=10.0.0.1
+	'unknown dictionary index' => '35jeo8oe1usg',
+	'invalid digit' => 'm1n304nu1sd2so-k',
+	'empty' => '',
+];
+
+foreach ($tokens as $name => $token) {
+	echo $name, ":\n";
+	var_dump(is_array(dtoken_parse($token)));
+
+	try {
+		new Dtoken\Token($token);
+		echo "object created\n";
+	} catch (ValueError $e) {
+		echo $e->getMessage(), "\n";
+	}
+}
+?>
+--EXPECTF--
+valid:
+bool(true)
+object created
+unknown kind:
+
+Warning: dtoken_parse(): $token is not a valid token in %s on line %d
+bool(false)
+Dtoken\Token::__construct(): Argument #1 ($token) is not a valid token
+wrong version:
+
+Warning: dtoken_parse(): $token is not a valid token in %s on line %d
+bool(false)
+Dtoken\Token::__construct(): Argument #1 ($token) is not a valid token
+unknown prefix:
+
+Warning: dtoken_parse(): $token is not a valid token in %s on line %d
+bool(false)
+Dtoken\Token::__construct(): Argument #1 ($token) is not a valid token
+unknown dictionary index:
+
+Warning: dtoken_parse(): $token is not a valid token in %s on line %d
+bool(false)
+Dtoken\Token::__construct(): Argument #1 ($token) is not a valid token
+invalid digit:
+
+Warning: dtoken_parse(): $token is not a valid token in %s on line %d
+bool(false)
+Dtoken\Token::__construct(): Argument #1 ($token) is not a valid token
+empty:
+
+Warning: dtoken_parse(): $token is not a valid token in %s on line %d
+bool(false)
+Dtoken\Token::__construct(): Argument #1 ($token) is not a valid token
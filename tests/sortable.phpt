@@ -0,0 +1,36 @@
+--TEST--
+Sortable tokens sort by precision, then by time
+--EXTENSIONS--
+dtoken
+--FILE--
+<?php
+// Base 64 is left out, its alphabet is not in ASCII order
+foreach ([DTOKEN_BASE36, DTOKEN_BASE32, DTOKEN_RAW] as $encoding) {
+	$tokens = [];
+
+	// Later tokens have lower addresses, methods and ids, which sort first in the standard layout
+	for ($i = 0; $i < 50; $i++) {
+		$address = sprintf('[2001:db8::%x]:%d', 0xffff - $i * 997, 65535 - $i);
+		$tokens[] = dtoken_build(9 - $i % 9, 0, 1700000000 + $i * 7919, $address, null, null, 8388607 - $i, null, DTOKEN_SORTABLE, $encoding);
+		$tokens[] = dtoken_build(9 - $i % 9, 1, 1700000000000000 + $i * 7919, '255.255.255.255', null, null, null, null, DTOKEN_SORTABLE, $encoding);
+	}
+
+	$sorted = $tokens;
+	sort($sorted, SORT_STRING);
+
+	$parsed = array_map(fn ($token) => dtoken_parse($token, $encoding), $sorted);
+	$times = array_map(fn ($data) => [$data['precision'], $data['timestamp']], $parsed);
+	$expected = $times;
+	sort($expected);
+
+	var_dump($times === $expected);
+	var_dump(count(array_unique(array_map('strlen', $tokens))));
+}
+?>
+--EXPECT--
+bool(true)
+int(1)
+bool(true)
+int(1)
+bool(true)
+int(1)
@@ -0,0 +1,83 @@
+--TEST--
+Dtoken\Token fields
+--EXTENSIONS--
+dtoken
+--FILE--
+<?php
+$token = new Dtoken\Token(dtoken_build(2, 0, 1700000000, '[2001:db8::1]:443', '10.0.0.1', null, 5, null));
+
+var_dump($token->timestamp, $token->client, $token->client_port, $token->server);
+var_dump($token);
+echo json_encode($token), "\n";
+
+// The fields are the values of dtoken_parse(), with the client named client
+var_dump(array_values((array)$token) === array_values(dtoken_parse(dtoken_build(2, 0, 1700000000, '[2001:db8::1]:443', '10.0.0.1', null, 5, null))));
+
+var_dump(isset($token->client), isset($token->server), isset($token->other), empty($token->id2));
+var_dump($token->other);
+
+try {
+	$token->client = '1.2.3.4';
+} catch (Error $e) {
+	echo $e->getMessage(), "\n";
+}
+
+try {
+	unset($token->client);
+} catch (Error $e) {
+	echo $e->getMessage(), "\n";
+}
+
+$token = new Dtoken\Token(dtoken_build(7, 1, 1700000000123456, null, null, null, null, 3, 0, DTOKEN_BASE64URL), DTOKEN_BASE64URL);
+var_dump($token->method, $token->timestamp, $token->id2);
+
+try {
+	new Dtoken\Token('abc', 4);
+} catch (ValueError $e) {
+	echo $e->getMessage(), "\n";
+}
+?>
+--EXPECTF--
+int(1700000000)
+string(11) "2001:db8::1"
+int(443)
+NULL
+object(Dtoken\Token)#%d (11) {
+  ["precision"]=>
+  int(0)
+  ["timestamp"]=>
+  int(1700000000)
+  ["method"]=>
+  int(2)
+  ["client"]=>
+  string(11) "2001:db8::1"
+  ["client_port"]=>
+  int(443)
+  ["balancer"]=>
+  string(8) "10.0.0.1"
+  ["balancer_port"]=>
+  NULL
+  ["server"]=>
+  NULL
+  ["server_port"]=>
+  NULL
+  ["id1"]=>
+  int(5)
+  ["id2"]=>
+  NULL
+}
+{"precision":0,"timestamp":1700000000,"method":2,"client":"2001:db8::1","client_port":443,"balancer":"10.0.0.1","balancer_port":null,"server":null,"server_port":null,"id1":5,"id2":null}
+bool(true)
+bool(true)
+bool(false)
+bool(false)
+bool(true)
+
+Warning: Undefined property: Dtoken\Token::$other in %s on line %d
+NULL
+Cannot modify readonly property Dtoken\Token::$client
+Cannot unset readonly property Dtoken\Token::$client
+int(7)
+int(1700000000123456)
+int(3)
+Dtoken\Token::__construct(): Argument #2 ($encoding) must be one of the DTOKEN_BASE36, DTOKEN_BASE32, DTOKEN_BASE64URL or DTOKEN_RAW constants
@@ -0,0 +1,44 @@
+--TEST--
+The client is read from the Forwarded header of a trusted proxy
+--EXTENSIONS--
+dtoken
+--INI--
+dtoken.trusted_proxies=10.0.0.0/8, 2001:db8::/32
+--ENV--
+REMOTE_ADDR=10.0.0.5
+REMOTE_PORT=41000
+HTTP_FORWARDED=for=192.0.2.60, For = "[2001:db9::7]:4711";proto=https, for=10.0.0.9;by=10.0.0.5
+HTTP_X_FORWARDED_FOR=198.51.100.1
+--FILE--
+<?php
+// The CLI only gives the environment through $_SERVER
+var_dump($_SERVER['REMOTE_ADDR']);
+
+// The last hop is a trusted proxy too, the one before it is the client
+$data = dtoken_parse(dtoken_build());
+var_dump($data['address'], $data['address_port'], $data['balancer'], $data['balancer_port']);
+
+// Given addresses take precedence
+$data = dtoken_parse(dtoken_build(null, null, null, null, '10.9.9.9'));
+var_dump($data['address'], $data['balancer']);
+
+$data = dtoken_parse(dtoken_build(null, null, null, '203.0.113.5'));
+var_dump($data['address'], $data['balancer']);
+
+// Builders never read the request
+$builder = new Dtoken\Builder();
+$data = dtoken_parse($builder->build());
+var_dump($data['address'], $data['balancer']);
+?>
+--EXPECT--
+string(8) "10.0.0.5"
+string(11) "2001:db9::7"
+int(4711)
+string(8) "10.0.0.5"
+int(41000)
+string(11) "2001:db9::7"
+string(8) "10.9.9.9"
+string(11) "203.0.113.5"
+NULL
+NULL
+NULL
@@ -0,0 +1,23 @@
+--TEST--
+The client is left out when a trusted proxy hides it
+--EXTENSIONS--
+dtoken
+--INI--
+dtoken.trusted_proxies=10.0.0.0/8
+--ENV--
+REMOTE_ADDR=10.0.0.5
+HTTP_FORWARDED=for=198.51.100.7, for=_hidden, for=10.0.0.9
+--FILE--
+<?php
+// The CLI only gives the environment through $_SERVER
+var_dump($_SERVER['REMOTE_ADDR']);
+
+// The address before the obfuscated hop could have been sent by anyone
+$data = dtoken_parse(dtoken_build());
+var_dump($data['address'], $data['balancer'], $data['balancer_port']);
+?>
+--EXPECT--
+string(8) "10.0.0.5"
+NULL
+string(8) "10.0.0.5"
+NULL
@@ -0,0 +1,24 @@
+--TEST--
+Forwarded headers are ignored when the request does not come from a trusted proxy
+--EXTENSIONS--
+dtoken
+--INI--
+dtoken.trusted_proxies=10.0.0.0/8
+--ENV--
+REMOTE_ADDR=192.0.2.1
+REMOTE_PORT=50000
+HTTP_FORWARDED=for=198.51.100.8
+HTTP_X_FORWARDED_FOR=198.51.100.7
+--FILE--
+<?php
+// The CLI only gives the environment through $_SERVER
+var_dump($_SERVER['REMOTE_ADDR']);
+
+$data = dtoken_parse(dtoken_build());
+var_dump($data['address'], $data['address_port'], $data['balancer']);
+?>
+--EXPECT--
+string(9) "192.0.2.1"
+string(9) "192.0.2.1"
+int(50000)
+NULL
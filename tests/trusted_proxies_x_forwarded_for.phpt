@@ -0,0 +1,25 @@
+--TEST--
+The client is read from the X-Forwarded-For header of a trusted proxy
+--EXTENSIONS--
+dtoken
+--INI--
+dtoken.trusted_proxies=10.0.0.0/8, 2001:db8::/32
+--ENV--
+REMOTE_ADDR=2001:db8::1
+REMOTE_PORT=443
+HTTP_X_FORWARDED_FOR=unknown, 198.51.100.7:8443, 10.1.2.3
+--FILE--
+<?php
+// The CLI only gives the environment through $_SERVER
+var_dump($_SERVER['REMOTE_ADDR']);
+
+// Hops left of the client are not followed, even if they cannot be read
+$data = dtoken_parse(dtoken_build());
+var_dump($data['address'], $data['address_port'], $data['balancer'], $data['balancer_port']);
+?>
+--EXPECT--
+string(11) "2001:db8::1"
+string(12) "198.51.100.7"
+int(8443)
+string(11) "2001:db8::1"
+int(443)
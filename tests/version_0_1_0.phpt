@@ -0,0 +1,71 @@
+--TEST--
+Tokens written by Dtoken 0.1.0 are still read
+--EXTENSIONS--
+dtoken
+--FILE--
+<?php
+// Built by the 0.1.0 extension, whose IPv6 addresses have no compact bit
+$ipv4 = 'dbgrwelceu3m6fz0phs';
+$ipv6 = '18pvtl4yd813cuxwq9fiv89t58bgq1d20g8pwfhlyjbyrrp0selke4pqizvhyxcdgu1739rgq1oi0m2vk';
+
+var_dump(dtoken_parse($ipv4));
+var_dump(dtoken_parse($ipv6));
+
+$token = new Dtoken\Token($ipv6);
+var_dump($token->client, $token->server, $token->id2);
+
+var_dump(dtoken_parse(dtoken_convert($ipv6, DTOKEN_BASE36, DTOKEN_RAW), DTOKEN_RAW) === dtoken_parse($ipv6));
+?>
+--EXPECT--
+array(11) {
+  ["precision"]=>
+  int(0)
+  ["timestamp"]=>
+  int(1700000000)
+  ["method"]=>
+  int(1)
+  ["address"]=>
+  string(9) "192.0.2.1"
+  ["address_port"]=>
+  int(443)
+  ["balancer"]=>
+  NULL
+  ["balancer_port"]=>
+  NULL
+  ["server"]=>
+  NULL
+  ["server_port"]=>
+  NULL
+  ["id1"]=>
+  NULL
+  ["id2"]=>
+  NULL
+}
+array(11) {
+  ["precision"]=>
+  int(1)
+  ["timestamp"]=>
+  int(1700000000123456)
+  ["method"]=>
+  int(2)
+  ["address"]=>
+  string(11) "2001:db8::1"
+  ["address_port"]=>
+  int(8080)
+  ["balancer"]=>
+  string(8) "10.0.0.1"
+  ["balancer_port"]=>
+  NULL
+  ["server"]=>
+  string(16) "::ffff:192.0.2.7"
+  ["server_port"]=>
+  NULL
+  ["id1"]=>
+  int(42)
+  ["id2"]=>
+  int(7)
+}
+string(11) "2001:db8::1"
+string(16) "::ffff:192.0.2.7"
+int(7)
+bool(true)